@@ -14,26 +14,54 @@ void BlockCache::dump() {
 		blocks, mMap.weight() / 1024.0 / 1024);
 	
 	for (iter = mMap.begin(); iter != mMap.end(); ++iter) {
-		fprintf(stderr, "  %9" PRIu64 " %s\n", uint64_t(iter->key.offset),
-			iter->key.id.c_str());
+		fprintf(stderr, "  %9" PRIu64 " file %" PRIu64 "\n",
+			uint64_t(iter->key.offset), iter->key.id);
 	}
 }
 
+// Errors get passed back to the reader, rather than killing the worker
 void BlockCache::Job::operator()() {
+	std::string error, formatFile;
+	bool verifyFailed = false, formatFailed = false;
+	try {
+		run();
+	} catch (Verifier::Failure& e) {
+		error = e.what();
+		verifyFailed = true;
+	} catch (CompressedFile::FormatException& e) {
+		error = e.what();
+		formatFile = e.file;
+		formatFailed = true;
+	} catch (std::runtime_error& e) {
+		error = e.what();
+	}
+	
+	Lock lock(info.cv);
+	if (!error.empty() && info.error.empty()) {
+		info.error = error;
+		info.formatFile = formatFile;
+		info.verifyFailed = verifyFailed;
+		info.formatFailed = formatFailed;
+	}
+	if (--info.remain == 0)
+		info.cv.signal();
+}
+
+void BlockCache::Job::run() {
 	bool done = false;
 	{
 		// We could have acquired the block between queuing and runnnig
 		Lock lock(info.cache.mMutex);
 		BufPtr *buf = info.cache.mMap.find(block.key);
 		if (buf) {
-			info.cb(*block.biter, *buf);
+			info.cb(block.block, *buf);
 			done = true;
 		}
 	}
 	
 	if (!done) {
 		BufPtr nbuf(new Buffer());
-		info.file.decompressBlock(*block.biter, *nbuf);
+		info.file.decompressBlock(block.block, *nbuf);
 		{
 			Lock lock(info.cache.mMutex);
 			try {
@@ -42,26 +70,22 @@ void BlockCache::Job::operator()() {
 				// that's ok!
 			}
 		}
-		info.cb(*block.biter, nbuf);
+		info.cb(block.block, nbuf);
 	}
-	
-	Lock lock(info.cv);
-	if (--info.remain == 0)
-		info.cv.signal();
 }
 
-void BlockCache::getBlocks(const OpenCompressedFile& file, BlockIterator& it,
-		off_t max, Callback& cb) {
-	std::vector<NeededBlock> need;	
+void BlockCache::getBlocks(const OpenCompressedFile& file,
+		const Block *blocks, size_t count, Callback& cb) {
+	std::vector<NeededBlock> need; // Only allocates if we miss
 	{
 		Lock lock(mMutex);
-		for (; !it.end() && (off_t)it->uoff < max; ++it) {
-			Key k(file.id(), it->coff);
+		for (size_t i = 0; i < count; ++i) {
+			Key k(file.id(), blocks[i].coff);
 			BufPtr *buf = mMap.find(k);
 			if (buf)
-				cb(*it, *buf);
+				cb(blocks[i], *buf);
 			else
-				need.push_back(NeededBlock(it, k));
+				need.push_back(NeededBlock(blocks[i], k));
 		}
 	}
 	if (need.empty())
@@ -75,5 +99,13 @@ void BlockCache::getBlocks(const OpenCompressedFile& file, BlockIterator& it,
 			nb != need.end(); ++nb) {
 		mPool.enqueue(new Job(info, *nb));
 	}
-	cv.wait();
+	while (remain)
+		cv.wait();
+	
+	if (info.verifyFailed)
+		throw Verifier::Failure(info.error);
+	if (info.formatFailed)
+		throw CompressedFile::FormatException(info.formatFile, info.error);
+	if (!info.error.empty())
+		throw std::runtime_error(info.error);
 }
@@ -15,8 +15,6 @@ public:
 		virtual void operator()(const Block& block, BufPtr& buf) = 0;
 	};
 	
-	typedef CompressedFile::BlockIterator BlockIterator;
-	
 protected:
 	struct Key {
 		OpenCompressedFile::FileID id;
@@ -28,16 +26,15 @@ protected:
 	};
 	struct KeyHasher {
 		size_t operator()(const Key& k) const {
-			return hash<std::string>()(k.id) * 37 + k.offset;
+			return hash<OpenCompressedFile::FileID>()(k.id) * 37 + k.offset;
 		}
 	};
 	
 	
 	struct NeededBlock {
-		BlockIterator biter;
+		Block block;
 		Key key;
-		NeededBlock(const BlockIterator& bi, const Key& k)
-			: biter(bi), key(k) { }
+		NeededBlock(const Block& b, const Key& k) : block(b), key(k) { }
 	};
 	
 	struct JobInfo {
@@ -46,9 +43,13 @@ protected:
 		Callback& cb;
 		ConditionVariable& cv;
 		size_t& remain;
+		std::string error; // first failure, if any
+		std::string formatFile; // if the failure was a format error
+		bool verifyFailed, formatFailed;
 		JobInfo(BlockCache& c, const OpenCompressedFile& f, Callback& pcb,
 			ConditionVariable& pcv, size_t& r)
-			: cache(c), file(f), cb(pcb), cv(pcv), remain(r) { }
+			: cache(c), file(f), cb(pcb), cv(pcv), remain(r),
+			verifyFailed(false), formatFailed(false) { }
 	};
 	
 	struct Job : public ThreadPool::Job {
@@ -57,6 +58,7 @@ protected:
 		
 		Job(JobInfo& i, NeededBlock& b) : info(i), block(b) { }
 		virtual void operator()();
+		void run();
 	};
 	friend struct Job;
 	
@@ -73,8 +75,8 @@ public:
 	
 	void dump();
 	
-	void getBlocks(const OpenCompressedFile& file, BlockIterator& it,
-		off_t max, Callback& cb);
+	void getBlocks(const OpenCompressedFile& file, const Block *blocks,
+		size_t count, Callback& cb);
 };
 
 #endif // BLOCKCACHE_H
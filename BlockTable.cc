@@ -0,0 +1,313 @@
+#include "BlockTable.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+	struct GroupFirstOrdering {
+		template <typename G>
+		bool operator()(size_t i, const G& g) const { return i < g.first; }
+	};
+	struct GroupOffsetOrdering {
+		template <typename G>
+		bool operator()(uint64_t off, const G& g) const { return off < g.uoff; }
+	};
+
+	// Starts a table image. Every section is padded to 8 bytes.
+	struct ImageHeader {
+		uint64_t blocks, groups, hasAux, uend;
+	};
+	
+	size_t padded(size_t bytes) { return (bytes + 7) & ~size_t(7); }
+	
+	template <typename T>
+	void writeSection(FileHandle& fh, const T *data, size_t n) {
+		static const uint8_t zeroes[8] = { 0 };
+		size_t bytes = n * sizeof(T);
+		if (bytes)
+			fh.write(data, bytes);
+		if (padded(bytes) != bytes)
+			fh.write(zeroes, padded(bytes) - bytes);
+	}
+	
+	// Point t at the next section, if there's enough room for it
+	template <typename T>
+	bool readSection(const uint8_t *&data, const uint8_t *end, size_t n,
+			const T *&t) {
+		if (n > size_t(end - data) / sizeof(T))
+			return false;
+		t = reinterpret_cast<const T*>(data);
+		data += padded(n * sizeof(T));
+		return data <= end;
+	}
+	
+	// Check everything that indexes another section, so a damaged image
+	// can't send lookups out of bounds
+	template <typename G>
+	bool validGroups(const G *groups, size_t ngroups, size_t blocks,
+			size_t groupSize, const uint64_t *search,
+			const uint64_t *searchGroup) {
+		if ((ngroups == 0) != (blocks == 0))
+			return false;
+		for (size_t g = 0; g < ngroups; ++g) {
+			const uint64_t end = g + 1 < ngroups ? groups[g + 1].first : blocks;
+			if ((g == 0 && groups[g].first != 0) || end <= groups[g].first
+					|| end - groups[g].first > groupSize)
+				return false;
+			if (g > 0 && groups[g].uoff < groups[g - 1].uoff)
+				return false;
+		}
+		for (size_t k = 1; k <= ngroups; ++k) {
+			if (searchGroup[k] >= ngroups
+					|| search[k] != groups[searchGroup[k]].uoff)
+				return false;
+		}
+		return true;
+	}
+}
+
+size_t BlockTable::groupOf(size_t i) const {
+	const Group *iter = std::upper_bound(mGroups.begin(), mGroups.end(), i,
+		GroupFirstOrdering());
+	return iter - mGroups.begin() - 1;
+}
+
+size_t BlockTable::groupEnd(size_t g) const {
+	return g + 1 < mGroups.size() ? mGroups[g + 1].first : size();
+}
+
+void BlockTable::push_back(const Block& b, uint64_t aux) {
+	// Start a new group if this block can't be expressed relative to the
+	// last one
+	bool fresh = mGroups.empty();
+	if (!fresh) {
+		const Group& g = mGroups.back();
+		fresh = size() - g.first >= GroupSize || b.uoff != mUEnd
+			|| b.coff < g.coff || b.coff - g.coff > UINT32_MAX;
+	}
+	if (fresh)
+		mGroups.push_back(Group(b.uoff, b.coff, size()));
+	if (!mSearch.empty()) {
+		mSearch.clear();
+		mSearchGroup.clear();
+	}
+
+	mUSize.push_back(b.usize);
+	mCSize.push_back(b.csize);
+	mCRel.push_back(b.coff - mGroups.back().coff);
+	if (aux || !mAux.empty()) {
+		mAux.resize(size() - 1, 0); // Fill in any zeroes we skipped
+		mAux.push_back(aux);
+	}
+	mUEnd = b.uoff + b.usize;
+}
+
+void BlockTable::truncate(size_t n) {
+	if (n >= size())
+		return;
+
+	while (!mGroups.empty() && mGroups.back().first >= n)
+		mGroups.pop_back();
+	mSearch.clear();
+	mSearchGroup.clear();
+	mUSize.resize(n);
+	mCSize.resize(n);
+	mCRel.resize(n);
+	if (!mAux.empty())
+		mAux.resize(n);
+
+	if (n == 0) {
+		mAux.clear();
+		mUEnd = 0;
+	} else {
+		Block b;
+		get(n - 1, b);
+		mUEnd = b.uoff + b.usize;
+	}
+}
+
+void BlockTable::clear() {
+	mGroups.clear();
+	mUSize.clear();
+	mCSize.clear();
+	mCRel.clear();
+	mAux.clear();
+	mSearch.clear();
+	mSearchGroup.clear();
+	mUEnd = 0;
+}
+
+size_t BlockTable::memory() const {
+	return mGroups.memory() + mUSize.memory() + mCSize.memory()
+		+ mCRel.memory() + mAux.memory() + mSearch.memory()
+		+ mSearchGroup.memory();
+}
+
+void BlockTable::compact() {
+	if (!mSearch.empty())
+		return; // Already done
+	
+	mGroups.shrink();
+	mUSize.shrink();
+	mCSize.shrink();
+	mCRel.shrink();
+	mAux.shrink();
+	
+	std::vector<uint64_t> search(mGroups.size() + 1),
+		group(mGroups.size() + 1);
+	layout(search, group, 0, 1);
+	mSearch.swap(search);
+	mSearchGroup.swap(group);
+}
+
+// Fill in the subtree at k with groups starting at g, returning the next
+size_t BlockTable::layout(std::vector<uint64_t>& search,
+		std::vector<uint64_t>& group, size_t g, size_t k) const {
+	if (k > mGroups.size())
+		return g;
+	g = layout(search, group, g, 2 * k);
+	search[k] = mGroups[g].uoff;
+	group[k] = g;
+	return layout(search, group, g + 1, 2 * k + 1);
+}
+
+// The last group starting at or before off, or the first group
+size_t BlockTable::groupAt(uint64_t off) const {
+	const size_t n = mGroups.size();
+	size_t upper; // The first group starting after off
+	if (mSearch.empty()) {
+		upper = std::upper_bound(mGroups.begin(), mGroups.end(), off,
+			GroupOffsetOrdering()) - mGroups.begin();
+	} else {
+		size_t k = 1;
+		while (k <= n)
+			k = 2 * k + (mSearch[k] <= off);
+		// Back up to where we last went left
+		while (k & 1)
+			k >>= 1;
+		k >>= 1;
+		upper = k ? mSearchGroup[k] : n;
+	}
+	return upper ? upper - 1 : 0;
+}
+
+uint64_t BlockTable::get(size_t i, Block& b) const {
+	const Group& g = mGroups[groupOf(i)];
+	uint64_t uoff = g.uoff;
+	for (size_t k = g.first; k < i; ++k)
+		uoff += mUSize[k];
+
+	b.uoff = uoff;
+	b.coff = g.coff + mCRel[i];
+	b.usize = mUSize[i];
+	b.csize = mCSize[i];
+	return mAux.empty() ? 0 : mAux[i];
+}
+
+size_t BlockTable::find(uint64_t off) const {
+	if (mGroups.empty())
+		return npos;
+
+	size_t g = groupAt(off);
+	uint64_t uoff = mGroups[g].uoff;
+	size_t end = groupEnd(g);
+	for (size_t k = mGroups[g].first; k < end; ++k) {
+		uoff += mUSize[k];
+		if (off < uoff)
+			return k;
+	}
+
+	// Off is past this group, maybe in a gap before the next
+	return end < size() ? end : npos;
+}
+
+size_t BlockTable::span(size_t i, uint64_t end, Block *blocks, size_t max)
+		const {
+	if (i >= size())
+		return 0;
+	
+	size_t g = groupOf(i), next = groupEnd(g);
+	Block b;
+	get(i, b);
+	uint64_t uoff = b.uoff;
+	size_t n = 0;
+	for (; n < max && i < size(); ++i) {
+		if (i == next) {
+			++g;
+			next = groupEnd(g);
+			uoff = mGroups[g].uoff;
+		}
+		if (uoff >= end)
+			break;
+		if (mUSize[i]) {
+			Block& o = blocks[n++];
+			o.uoff = uoff;
+			o.coff = mGroups[g].coff + mCRel[i];
+			o.usize = mUSize[i];
+			o.csize = mCSize[i];
+		}
+		uoff += mUSize[i];
+	}
+	return n;
+}
+
+void BlockTable::write(FileHandle& fh) const {
+	ImageHeader hdr = { size(), mGroups.size(), !mAux.empty(), mUEnd };
+	fh.write(&hdr, sizeof(hdr));
+	writeSection(fh, mGroups.begin(), mGroups.size());
+	writeSection(fh, mSearch.begin(), mSearch.size());
+	writeSection(fh, mSearchGroup.begin(), mSearchGroup.size());
+	writeSection(fh, mUSize.begin(), mUSize.size());
+	writeSection(fh, mCSize.begin(), mCSize.size());
+	writeSection(fh, mCRel.begin(), mCRel.size());
+	writeSection(fh, mAux.begin(), mAux.size());
+}
+
+bool BlockTable::attach(const uint8_t *data, size_t size) {
+	const uint8_t *end = data + size;
+	if (reinterpret_cast<uintptr_t>(data) % 8 || size < sizeof(ImageHeader))
+		return false;
+	ImageHeader hdr;
+	memcpy(&hdr, data, sizeof(hdr));
+	data += sizeof(hdr);
+	if (hdr.hasAux > 1 || hdr.groups > hdr.blocks
+			|| hdr.blocks > size / sizeof(uint32_t))
+		return false;
+	
+	const Group *groups;
+	const uint64_t *search, *searchGroup, *aux = 0;
+	const uint32_t *usize, *csize, *crel;
+	size_t blocks = hdr.blocks, nsearch = hdr.groups + 1;
+	if (!readSection(data, end, hdr.groups, groups)
+			|| !readSection(data, end, nsearch, search)
+			|| !readSection(data, end, nsearch, searchGroup)
+			|| !readSection(data, end, blocks, usize)
+			|| !readSection(data, end, blocks, csize)
+			|| !readSection(data, end, blocks, crel)
+			|| (hdr.hasAux && !readSection(data, end, blocks, aux))
+			|| data != end)
+		return false;
+	if (!validGroups(groups, hdr.groups, blocks, GroupSize, search,
+			searchGroup))
+		return false;
+	
+	// The end follows from the last group, and gives the file's size
+	uint64_t uend = 0;
+	if (blocks) {
+		uend = groups[hdr.groups - 1].uoff;
+		for (size_t i = groups[hdr.groups - 1].first; i < blocks; ++i)
+			uend += usize[i];
+	}
+	if (uend != hdr.uend)
+		return false;
+	
+	mGroups.borrow(groups, hdr.groups);
+	mSearch.borrow(search, nsearch);
+	mSearchGroup.borrow(searchGroup, nsearch);
+	mUSize.borrow(usize, blocks);
+	mCSize.borrow(csize, blocks);
+	mCRel.borrow(crel, blocks);
+	mAux.borrow(aux, aux ? blocks : 0);
+	mUEnd = hdr.uend;
+	return true;
+}
@@ -0,0 +1,134 @@
+#ifndef BLOCKTABLE_H
+#define BLOCKTABLE_H
+
+#include "lzopfs.h"
+#include "FileHandle.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+/* A compact table of blocks, in order of uncompressed offset.
+ *
+ * Instead of an object per block, each field has its own array. Blocks are
+ * grouped, and only the start of each group has full 64-bit offsets: within
+ * a group, uncompressed offsets are summed from the sizes, and compressed
+ * offsets are 32 bits relative to the group. Anything else a format needs
+ * is packed into 64 bits of auxiliary data, which isn't stored at all
+ * until some block has any. That's about 20 bytes per block.
+ *
+ * Once the table stops growing, the group offsets are also laid out in
+ * Eytzinger (breadth-first) order, so searches touch fewer cache lines.
+ *
+ * A finished table can be written out as an image, and later used in place
+ * from a memory map without any parsing. */
+class BlockTable {
+public:
+	static const size_t GroupSize = 16;
+	static const size_t npos = size_t(-1);
+
+protected:
+	struct Group {
+		uint64_t uoff, coff, first;
+		Group(uint64_t u = 0, uint64_t c = 0, uint64_t f = 0)
+			: uoff(u), coff(c), first(f) { }
+	};
+	
+	// An array that we either own, or borrow from an image. Changing a
+	// borrowed array makes a copy first.
+	template <typename T>
+	class Column {
+		std::vector<T> mOwn;
+		const T *mData;
+		size_t mSize;
+		bool mBorrowed;
+		
+		void sync() {
+			mData = mOwn.empty() ? 0 : &mOwn[0];
+			mSize = mOwn.size();
+			mBorrowed = false;
+		}
+		void own(size_t n) {
+			if (mBorrowed)
+				mOwn.assign(mData, mData + std::min(n, mSize));
+		}
+	
+	public:
+		Column() : mData(0), mSize(0), mBorrowed(false) { }
+		
+		size_t size() const { return mSize; }
+		bool empty() const { return mSize == 0; }
+		size_t memory() const { return mOwn.capacity() * sizeof(T); }
+		const T& operator[](size_t i) const { return mData[i]; }
+		const T& back() const { return mData[mSize - 1]; }
+		const T *begin() const { return mData; }
+		const T *end() const { return mData + mSize; }
+		
+		void push_back(const T& t) { own(mSize); mOwn.push_back(t); sync(); }
+		void pop_back() { resize(mSize - 1); }
+		void resize(size_t n, const T& t = T())
+			{ own(n); mOwn.resize(n, t); sync(); }
+		void clear() { std::vector<T>().swap(mOwn); sync(); }
+		void swap(std::vector<T>& v) { own(mSize); mOwn.swap(v); sync(); }
+		void shrink() { own(mSize); std::vector<T>(mOwn).swap(mOwn); sync(); }
+		void borrow(const T *data, size_t n) {
+			std::vector<T>().swap(mOwn);
+			mData = data;
+			mSize = n;
+			mBorrowed = true;
+		}
+	};
+
+	Column<Group> mGroups;
+	Column<uint32_t> mUSize, mCSize, mCRel;
+	Column<uint64_t> mAux;
+	uint64_t mUEnd;
+	
+	// Eytzinger order group offsets, one-based, and their group numbers
+	Column<uint64_t> mSearch, mSearchGroup;
+
+	size_t groupOf(size_t i) const;
+	size_t groupEnd(size_t g) const;
+	size_t groupAt(uint64_t off) const;
+	size_t layout(std::vector<uint64_t>& search, std::vector<uint64_t>& group,
+		size_t g, size_t k) const;
+
+public:
+	BlockTable() : mUEnd(0) { }
+
+	size_t size() const { return mUSize.size(); }
+	bool empty() const { return mUSize.empty(); }
+	uint64_t uncompressedEnd() const { return mUEnd; }
+
+	void push_back(const Block& b, uint64_t aux = 0);
+	void truncate(size_t n);
+	void clear(); // Releases all memory, too
+	
+	// Bytes of memory we own, not counting any image we use in place
+	size_t memory() const;
+
+	// Release any spare capacity and build the search layout, once the
+	// table stops growing
+	void compact();
+
+	// Fill in the block at index i, returning its auxiliary data
+	uint64_t get(size_t i, Block& b) const;
+
+	// The first block that ends after off, or npos if there's none
+	size_t find(uint64_t off) const;
+	
+	// Fill in up to max non-empty blocks starting at index i, stopping
+	// before end. Returns how many there were.
+	size_t span(size_t i, uint64_t end, Block *blocks, size_t max) const;
+	
+	// Write an image of a compacted table, in native byte order. Its size
+	// is a multiple of 8 bytes.
+	void write(FileHandle& fh) const;
+	
+	// Use an image in place, which must stay mapped as long as this table
+	// uses it. The data must be 8-byte aligned, and exactly the size that
+	// was written. Returns false if the image doesn't make sense.
+	bool attach(const uint8_t *data, size_t size);
+};
+
+#endif // BLOCKTABLE_H
@@ -0,0 +1,234 @@
+#ifdef HAVE_BZIP2
+
+#include "Bzip2Decoder.h"
+
+#include "Checksum.h"
+
+#include <algorithm>
+#include <cstring>
+
+const size_t Bzip2Decoder::MaxSelectors;
+
+void Bzip2Decoder::Table::build(const uint8_t *lens, size_t alphaSize) {
+	minLen = MaxCodeLen;
+	maxLen = 0;
+	for (size_t i = 0; i < alphaSize; ++i) {
+		minLen = std::min(minLen, size_t(lens[i]));
+		maxLen = std::max(maxLen, size_t(lens[i]));
+	}
+	
+	size_t pp = 0;
+	for (size_t i = minLen; i <= maxLen; ++i)
+		for (size_t j = 0; j < alphaSize; ++j)
+			if (lens[j] == i)
+				perm[pp++] = j;
+	
+	std::fill(base, base + MaxCodeLen + 2, 0);
+	std::fill(limit, limit + MaxCodeLen + 2, 0);
+	for (size_t i = 0; i < alphaSize; ++i)
+		base[lens[i] + 1]++;
+	for (size_t i = 1; i < MaxCodeLen + 2; ++i)
+		base[i] += base[i - 1];
+	
+	int32_t vec = 0;
+	for (size_t i = minLen; i <= maxLen; ++i) {
+		vec += base[i + 1] - base[i];
+		limit[i] = vec - 1;
+		vec <<= 1;
+	}
+	for (size_t i = minLen + 1; i <= maxLen; ++i)
+		base[i] = ((limit[i - 1] + 1) << 1) - base[i];
+}
+
+uint16_t Bzip2Decoder::Table::decode(BitReader& br, size_t alphaSize) const {
+	const uint32_t bits = br.peek(MaxCodeLen);
+	size_t len = minLen;
+	int32_t code = bits >> (MaxCodeLen - len);
+	while (code > limit[len]) {
+		if (++len > maxLen)
+			throw Exception("bzip2 bad huffman code");
+		code = bits >> (MaxCodeLen - len);
+	}
+	br.skip(len);
+	
+	const int32_t idx = code - base[len];
+	if (idx < 0 || size_t(idx) >= alphaSize)
+		throw Exception("bzip2 bad huffman code");
+	return perm[idx];
+}
+
+void Bzip2Decoder::decode(const uint8_t *data, size_t begin, size_t end,
+		char level, Buffer& out) {
+	if (level < '1' || level > '9')
+		throw Exception("bzip2 bad level");
+	const size_t maxBlock = 100000 * (level - '0');
+	
+	BitReader br(data, begin + MagicBits, end);
+	const uint32_t crc = (br.get(16) << 16) | br.get(16);
+	if (br.get(1))
+		throw Unsupported("bzip2 randomised block");
+	const uint32_t origPtr = br.get(24);
+	
+	// Symbol map
+	uint8_t seqToUnseq[256];
+	size_t inUse = 0;
+	const uint32_t used = br.get(16);
+	for (size_t i = 0; i < 16; ++i) {
+		if (!(used & (0x8000 >> i)))
+			continue;
+		const uint32_t syms = br.get(16);
+		for (size_t j = 0; j < 16; ++j)
+			if (syms & (0x8000 >> j))
+				seqToUnseq[inUse++] = i * 16 + j;
+	}
+	if (inUse == 0)
+		throw Exception("bzip2 no symbols");
+	const size_t alphaSize = inUse + 2;
+	
+	// Selectors, move-to-front coded
+	const size_t nGroups = br.get(3);
+	if (nGroups < 2 || nGroups > MaxGroups)
+		throw Exception("bzip2 bad group count");
+	const size_t nSelectors = br.get(15);
+	if (nSelectors < 1)
+		throw Exception("bzip2 no selectors");
+	Buffer selectors(std::min(nSelectors, MaxSelectors));
+	uint8_t groupMTF[MaxGroups];
+	for (size_t i = 0; i < nGroups; ++i)
+		groupMTF[i] = i;
+	for (size_t i = 0; i < nSelectors; ++i) {
+		size_t j = 0;
+		while (br.get(1)) {
+			if (++j >= nGroups)
+				throw Exception("bzip2 bad selector");
+		}
+		if (i >= MaxSelectors)
+			continue; // libbz2 ignores excess selectors
+		const uint8_t g = groupMTF[j];
+		std::copy_backward(groupMTF, groupMTF + j, groupMTF + j + 1);
+		groupMTF[0] = g;
+		selectors[i] = g;
+	}
+	
+	// Huffman tables, delta coded
+	Table tables[MaxGroups];
+	for (size_t t = 0; t < nGroups; ++t) {
+		uint8_t lens[MaxAlpha];
+		uint32_t len = br.get(5);
+		for (size_t i = 0; i < alphaSize; ++i) {
+			while (true) {
+				if (len < 1 || len > MaxCodeLen)
+					throw Exception("bzip2 bad code length");
+				if (!br.get(1))
+					break;
+				if (br.get(1))
+					--len;
+				else
+					++len;
+			}
+			lens[i] = len;
+		}
+		tables[t].build(lens, alphaSize);
+	}
+	if (br.overrun())
+		throw Exception("bzip2 truncated block");
+	
+	/* Undo the Huffman, run-length and move-to-front coding. The low byte of
+	 * each tt entry gets a byte of the BWT output. */
+	std::vector<uint32_t> tt(maxBlock);
+	uint32_t counts[256] = { 0 };
+	uint8_t mtf[256];
+	for (size_t i = 0; i < 256; ++i)
+		mtf[i] = i;
+	
+	const uint16_t eob = inUse + 1;
+	size_t nblock = 0, run = 0, runWeight = 1;
+	size_t group = 0, groupLeft = 0;
+	const Table *table = 0;
+	while (true) {
+		if (groupLeft == 0) {
+			if (group >= selectors.size())
+				throw Exception("bzip2 out of selectors");
+			table = &tables[selectors[group++]];
+			groupLeft = GroupSize;
+		}
+		--groupLeft;
+		const uint16_t sym = table->decode(br, alphaSize);
+		if (br.overrun())
+			throw Exception("bzip2 truncated block");
+		
+		if (sym <= 1) { // RUNA or RUNB
+			if (runWeight > maxBlock)
+				throw Exception("bzip2 run too long");
+			run += (sym + 1) * runWeight;
+			runWeight <<= 1;
+			continue;
+		}
+		if (run) {
+			if (run > maxBlock - nblock)
+				throw Exception("bzip2 block too big");
+			const uint8_t uc = seqToUnseq[mtf[0]];
+			counts[uc] += run;
+			std::fill(tt.begin() + nblock, tt.begin() + nblock + run, uc);
+			nblock += run;
+			run = 0;
+			runWeight = 1;
+		}
+		if (sym == eob)
+			break;
+		
+		if (nblock >= maxBlock)
+			throw Exception("bzip2 block too big");
+		const size_t n = sym - 1;
+		const uint8_t m = mtf[n];
+		memmove(mtf + 1, mtf, n);
+		mtf[0] = m;
+		const uint8_t uc = seqToUnseq[m];
+		++counts[uc];
+		tt[nblock++] = uc;
+	}
+	if (br.pos() != end)
+		throw Exception("bzip2 block has wrong length");
+	if (origPtr >= nblock)
+		throw Exception("bzip2 bad origPtr");
+	
+	// Inverse BWT, storing the next index in the high bits of tt
+	uint32_t cftab[256];
+	for (size_t i = 0, sum = 0; i < 256; ++i) {
+		cftab[i] = sum;
+		sum += counts[i];
+	}
+	for (size_t i = 0; i < nblock; ++i)
+		tt[cftab[tt[i] & 0xff]++] |= i << 8;
+	
+	// Walk the BWT and undo the initial run-length coding
+	out.clear();
+	out.reserve(nblock + nblock / 4);
+	uint32_t pos = tt[origPtr] >> 8;
+	int last = -1;
+	size_t same = 0;
+	for (size_t i = 0; i < nblock; ++i) {
+		pos = tt[pos];
+		const uint8_t c = pos & 0xff;
+		pos >>= 8;
+		
+		if (same == 4) {
+			out.insert(out.end(), c, uint8_t(last));
+			same = 0;
+			last = -1;
+			continue;
+		}
+		if (c == last) {
+			++same;
+		} else {
+			last = c;
+			same = 1;
+		}
+		out.push_back(c);
+	}
+	
+	if (Checksum::bzip2CRC(0, out.empty() ? 0 : &out[0], out.size()) != crc)
+		throw ChecksumError("bzip2 block CRC mismatch");
+}
+
+#endif // HAVE_BZIP2
@@ -0,0 +1,88 @@
+#ifndef BZIP2DECODER_H
+#define BZIP2DECODER_H
+
+#ifdef HAVE_BZIP2
+
+#include "lzopfs.h"
+
+#include <stdexcept>
+
+/* Decodes a single bzip2 block straight from memory, starting at any bit.
+ * Unlike libbz2, this needs no stream header or footer, and no realignment
+ * of the input. */
+class Bzip2Decoder {
+public:
+	struct Exception : public std::runtime_error {
+		Exception(const std::string& s) : std::runtime_error(s) { }
+	};
+	struct ChecksumError : public Exception {
+		ChecksumError(const std::string& s) : Exception(s) { }
+	};
+	// Randomised blocks are obsolete, we leave them to libbz2
+	struct Unsupported : public Exception {
+		Unsupported(const std::string& s) : Exception(s) { }
+	};
+	
+	// Reads big-endian bit fields, noting if it runs off the end
+	class BitReader {
+		const uint8_t *mData;
+		size_t mPos, mEnd; // in bits
+		size_t mBytes; // how much is actually readable
+		
+	public:
+		BitReader(const uint8_t *data, size_t pos, size_t end)
+			: mData(data), mPos(pos), mEnd(end), mBytes((end + 7) / 8) { }
+		
+		size_t pos() const { return mPos; }
+		bool overrun() const { return mPos > mEnd; }
+		
+		// Look at up to 24 bits without consuming them
+		uint32_t peek(size_t n) const {
+			const size_t byte = mPos / 8;
+			uint32_t v;
+			if (byte + 4 <= mBytes) {
+				const uint8_t *p = mData + byte;
+				v = (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+			} else {
+				v = 0;
+				for (size_t i = 0; i < 4; ++i)
+					v = (v << 8) | (byte + i < mBytes ? mData[byte + i] : 0);
+			}
+			return (v << (mPos % 8)) >> (32 - n);
+		}
+		void skip(size_t n) { mPos += n; }
+		uint32_t get(size_t n) {
+			uint32_t v = peek(n);
+			skip(n);
+			return v;
+		}
+	};
+	
+	static const size_t MagicBits = 48;
+	
+	// Decode the block whose magic starts at bit 'begin' of data, and which
+	// ends exactly at bit 'end'. Level is the stream's block size, '1'-'9'.
+	static void decode(const uint8_t *data, size_t begin, size_t end,
+		char level, Buffer& out);
+
+protected:
+	static const size_t MaxGroups = 6;
+	static const size_t MaxAlpha = 258;
+	static const size_t MaxCodeLen = 20;
+	static const size_t MaxSelectors = 18002;
+	static const size_t GroupSize = 50;
+	
+	// Canonical Huffman decoding table, as in libbz2
+	struct Table {
+		size_t minLen, maxLen;
+		int32_t limit[MaxCodeLen + 2], base[MaxCodeLen + 2];
+		uint16_t perm[MaxAlpha];
+		
+		void build(const uint8_t *lens, size_t alphaSize);
+		uint16_t decode(BitReader& br, size_t alphaSize) const;
+	};
+};
+
+#endif // HAVE_BZIP2
+
+#endif // BZIP2DECODER_H
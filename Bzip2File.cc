@@ -2,14 +2,25 @@
 
 #include "Bzip2File.h"
 
+#include "Bzip2Decoder.h"
+#include "MappedFile.h"
+#include "PairScanner.h"
 #include "PathUtils.h"
+#include "TR1.h"
 
 #include <algorithm>
+#include <stdexcept>
 
 #include <bzlib.h>
 
 const char Bzip2File::Magic[3] = { 'B', 'Z', 'h' };
 
+bool Bzip2File::sniff(const Buffer& head) {
+	return head.size() > sizeof(Magic)
+		&& std::equal(Magic, Magic + sizeof(Magic), head.begin())
+		&& head[sizeof(Magic)] >= '1' && head[sizeof(Magic)] <= '9';
+}
+
 void Bzip2File::checkFileType(FileHandle& fh) {
 	try {
 		Buffer buf;
@@ -33,74 +44,97 @@ void Bzip2File::checkFileType(FileHandle& fh) {
 	}
 }
 
-void Bzip2File::findBlockBoundaryCandidates(FileHandle& fh, BoundList &bl)
-		const {
+Bzip2File::ScanState::ScanState(off_t p, char l)
+	: pos(p), level(l), levelPos(l ? -1 : p + sizeof(Magic)) { }
+
+// Find candidates starting before end, and update st to continue from there
+void Bzip2File::findBlockBoundaryCandidates(const FileHandle& fh,
+		const MappedFile *map, BoundList &bl, ScanState& st, off_t end) const {
 	/* Block boundaries are not byte aligned, but checking each bit is
 	 * too expensive. So we only look at bytes that may be the first full
 	 * byte of a block magic number.
 	 *
-	 * We look up each byte in the table to determine whether it could be
-	 * the start of a magic number, and if so how many bits from the
-	 * previous byte we require. No first-byte appears twice in the shifted
-	 * magics, so a single table is fine. */
+	 * For each possible alignment, the first two full bytes of each magic
+	 * are known, so a PairScanner can skip quickly to plausible positions.
+	 * Then we look up the byte in the table to determine how many bits from
+	 * the previous byte we require. No first-byte appears twice in the
+	 * shifted magics, so a single table is fine. */
 	int8_t backBits[256];
 	for (size_t i = 0; i < 256; ++i)
 		backBits[i] = -1;
-	uint8_t m1 = BlockMagic >> ((BlockMagicBytes - 1) * 8),
-		m2 = (BlockMagic >> ((BlockMagicBytes - 2) * 8)) & 0xff,
-		e1 = EOSMagic >> ((BlockMagicBytes - 1) * 8),
-		e2 = (EOSMagic >> ((BlockMagicBytes - 2) * 8)) & 0xff;		
-	for (size_t i = 0; i < 8; ++i) {
-		uint8_t m = (m1 << i) | (m2 >> (8 - i)),
-			e = (e1 << i) | (e2 >> (8 - i));
-		backBits[m] = backBits[e] = i;
+	PairScanner scanner;
+	const uint64_t magics[] = { BlockMagic, EOSMagic };
+	for (size_t k = 0; k < 2; ++k) {
+		const uint64_t top = magics[k] << (64 - 8 * BlockMagicBytes);
+		for (size_t i = 0; i < 8; ++i) {
+			const uint64_t shifted = top << i;
+			const uint8_t m1 = shifted >> 56, m2 = (shifted >> 48) & 0xff;
+			backBits[m1] = i;
+			scanner.add(m1, m2);
+		}
 	}
 	
-	const off_t fsz = fh.size();
-	uint8_t buf[ChunkSize];
-	fh.seek(0, SEEK_SET);
-	size_t bsz = fh.tryRead(buf, ChunkSize);
-	off_t rpos = bsz; // next read pos
 	const size_t us = sizeof(uint64_t);
-	
 	const size_t ftsz = BlockMagicBytes + sizeof(uint32_t);
 	const size_t lcreset = sizeof(Magic);
-	size_t lcount = lcreset + 1; // how many more bytes til we can find a level?
-	char level = 0;
 	
-	while (true) {
-		const uint8_t *blast = buf + bsz - us;
-		for (uint8_t *i = buf; i < blast; ++i) {
-			if (lcount && !--lcount)
-				level = *i;
-			
-			const int8_t b = backBits[*i];
-			if (b == -1)
-				continue;
-			
-			// Candidate byte, check if this is a magic
-			uint64_t v = *reinterpret_cast<uint64_t*>(i);
-			FileHandle::convertBE(v);
-			v >>= 8 * (sizeof(uint64_t) - BlockMagicBytes) + b;
-			const uint64_t u = *(i - 1);
-			v |= (u << ((8 * BlockMagicBytes) - b)) & BlockMagicMask;
-			
-			const off_t pos = rpos - (buf + bsz - i);
-			if (v == BlockMagic || v == EOSMagic) {
-				DEBUG("%s %c %9lld %hhu",
-					(v == BlockMagic ? "block" : "eos  "), level, pos, b);
-				bl.push_back(BlockBoundary(v, level, pos, b));
-				if (v == EOSMagic)
-					lcount = ftsz + lcreset;
-			}
+	// Starting in the middle, we need the previous byte for alignment. Each
+	// candidate needs a whole word after it.
+	const off_t fsz = map ? off_t(map->size()) : fh.size();
+	end = std::min(end, fsz);
+	const off_t from = st.pos ? st.pos - 1 : 0;
+	const off_t until = std::min(end + off_t(us), fsz);
+	if (until <= from) {
+		st.pos = end;
+		return;
+	}
+	
+	// Prefer the map, otherwise read what we need
+	Buffer rbuf;
+	const uint8_t *buf;
+	if (map) {
+		buf = map->data() + from;
+	} else {
+		fh.pread(from, rbuf, until - from);
+		buf = &rbuf[0];
+	}
+	const uint8_t *first = buf + (st.pos - from);
+	const uint8_t *blast = buf + std::max(st.pos,
+		std::min(end, until - off_t(us))) - from;
+	
+	for (const uint8_t *i = first; i < blast; ++i) {
+		i = scanner.find(i, blast);
+		if (i == blast)
+			break;
+		const off_t pos = from + (i - buf);
+		if (st.levelPos != -1 && pos >= st.levelPos) {
+			st.level = buf[st.levelPos - from];
+			st.levelPos = -1;
 		}
-		if (fsz == rpos)
-			return;
-		std::copy(buf + bsz - us - 1, buf + bsz, buf);
-		const size_t r = fh.tryRead(buf + us + 1, ChunkSize - us - 1);
-		bsz = r + us + 1;
-		rpos += r;
+		
+		// Candidate byte, check if this is a magic
+		const int8_t b = backBits[*i];
+		uint64_t v;
+		std::copy(i, i + us, reinterpret_cast<uint8_t*>(&v));
+		FileHandle::convertBE(v);
+		v >>= 8 * (sizeof(uint64_t) - BlockMagicBytes) + b;
+		const uint64_t u = pos ? *(i - 1) : 0;
+		v |= (u << ((8 * BlockMagicBytes) - b)) & BlockMagicMask;
+		
+		if (v == BlockMagic || v == EOSMagic) {
+			DEBUG("%s %c %9lld %hhu",
+				(v == BlockMagic ? "block" : "eos  "), st.level, pos, b);
+			bl.push_back(BlockBoundary(v, st.level, pos, b));
+			if (v == EOSMagic)
+				st.levelPos = pos + ftsz + lcreset;
+		}
+	}
+	
+	if (st.levelPos != -1 && st.levelPos < end) {
+		st.level = buf[st.levelPos - from];
+		st.levelPos = -1;
 	}
+	st.pos = end;
 }
 
 // Create a buffer that looks like a one-block file
@@ -188,54 +222,300 @@ void Bzip2File::decompress(const Buffer& in, Buffer& out) const {
 	out.resize(out.size() - s.avail_out);
 }
 
-void Bzip2File::buildIndex(FileHandle& fh) {
-	BoundList bl;
-	findBlockBoundaryCandidates(fh, bl);
+/* Parse the start of a block straight from the bitstream, to weed out
+ * spurious boundaries without decompressing a whole block. The checks
+ * are the same ones libbz2 makes, so we never reject a real block. */
+bool Bzip2File::plausibleBlock(const FileHandle& fh, const BlockBoundary& start,
+		const BlockBoundary& end, char level) const {
+	// Read from the byte with the start of the magic
+	const off_t from = start.coff - (start.bits ? 1 : 0);
+	const off_t until = end.coff;
+	const size_t want = std::min(off_t(HeaderCheckSize), until - from);
+	Buffer buf(want);
+	buf.resize(fh.tryPRead(from, &buf[0], want));
+	
+	// Don't read bits belonging to the next block
+	size_t endBit = buf.size() * 8;
+	const bool whole = (from + off_t(buf.size()) >= until);
+	if (whole)
+		endBit = std::min(endBit, size_t(end.coff - from) * 8 - end.bits);
+	
+	if (buf.empty())
+		return false;
+	Bzip2Decoder::BitReader br(&buf[0], (start.bits ? 8 - start.bits : 0),
+		endBit);
+	br.skip(8 * BlockMagicBytes + 32); // magic, CRC
+	br.get(1); // randomised, deprecated but still legal
+	
+	const uint32_t origPtr = br.get(24);
+	if (level >= '1' && level <= '9'
+			&& origPtr > uint32_t(10 + 100000 * (level - '0')))
+		return false;
+	
+	// Symbol map
+	size_t inUse = 0;
+	const uint32_t groups = br.get(16);
+	for (size_t i = 0; i < 16; ++i) {
+		if (groups & (0x8000 >> i)) {
+			uint32_t syms = br.get(16);
+			for (; syms; syms &= syms - 1)
+				++inUse;
+		}
+	}
+	if (inUse == 0)
+		return false;
+	const size_t alphaSize = inUse + 2;
+	
+	// Huffman tables and selectors
+	const uint32_t nTables = br.get(3);
+	if (nTables < 2 || nTables > 6)
+		return false;
+	const uint32_t nSelectors = br.get(15);
+	if (nSelectors < 1)
+		return false;
+	for (size_t i = 0; i < nSelectors && !br.overrun(); ++i) {
+		size_t j = 0;
+		while (br.get(1)) {
+			if (++j >= nTables)
+				return false;
+		}
+	}
+	for (size_t t = 0; t < nTables && !br.overrun(); ++t) {
+		uint32_t len = br.get(5);
+		for (size_t i = 0; i < alphaSize && !br.overrun(); ++i) {
+			while (true) {
+				if (len < 1 || len > 20)
+					return false;
+				if (!br.get(1))
+					break;
+				if (br.get(1))
+					--len;
+				else
+					++len;
+			}
+		}
+	}
+	
+	// Running out is only bad if we saw the whole block
+	return !(br.overrun() && whole);
+}
+
+void Bzip2File::validate(const FileHandle& fh, const BlockBoundary& start,
+		const BlockBoundary& end, char level, Validation& result) const {
+	Buffer out;
+	result.level = level;
+	if (!plausibleBlock(fh, start, end, level)) {
+		result.ok = false;
+		return;
+	}
+	
+	// Decoding also checks the block CRC
+	try {
+		decodeBlock(fh, level, start.coff, start.bits, end.coff, end.bits,
+			out);
+	} catch (std::runtime_error& e) {
+		result.ok = false;
+		return;
+	}
+	result.ok = true;
+	result.usize = out.size();
+}
+
+void Bzip2File::ValidateJob::operator()() {
+	try {
+		info.file.validate(info.fh, start, end, start.level, result);
+	} catch (std::exception& e) {
+		// Leave it for the merge to retry, and report properly
+		result.ok = false;
+		result.level = 0;
+	}
+	
+	Lock lock(info.cv);
+	if (--info.remain == 0)
+		info.cv.signal();
+}
+
+shared_ptr<MappedFile> Bzip2File::mapping(const FileHandle& fh) const {
+	Lock lock(mMapMutex);
+	if (!mMap && !mMapFailed) {
+		try {
+			mMap.reset(new MappedFile(fh));
+		} catch (FileHandle::Exception& e) {
+			mMapFailed = true;
+		}
+	}
+	return mMap;
+}
+
+// Decoders may still be using the map, they keep it alive until they're done
+bool Bzip2File::unloadFile() {
+	if (!IndexedCompFile::unloadFile())
+		return false;
+	Lock lock(mMapMutex);
+	mMap.reset();
+	mMapFailed = false;
+	return true;
+}
+
+void Bzip2File::resetFile() {
+	IndexedCompFile::resetFile();
+	Lock lock(mMapMutex);
+	mMap.reset();
+	mMapFailed = false;
+}
+
+// Decode a block in place, preferably straight from a map of the file
+void Bzip2File::decodeBlock(const FileHandle& fh, char level, off_t coff,
+		size_t bits, off_t end, size_t endbits, Buffer& out) const {
+	const off_t from = coff - (bits ? 1 : 0);
+	const size_t size = end - from;
+	const size_t begin = bits ? 8 - bits : 0;
+	const size_t endBit = size * 8 - endbits;
 	
-	// Build blocklist from boundaries
+	try {
+		shared_ptr<MappedFile> map = mapping(fh);
+		Buffer in;
+		const uint8_t *data;
+		if (map && end <= off_t(map->size())) {
+			data = map->data() + from;
+		} else {
+			fh.pread(from, in, size);
+			data = &in[0];
+		}
+		Bzip2Decoder::decode(data, begin, endBit, level, out);
+	} catch (Bzip2Decoder::Unsupported& e) {
+		// Let libbz2 handle it
+		Buffer in;
+		createAlignedBlock(fh, in, level, coff, bits, end, endbits);
+		out.clear();
+		decompress(in, out);
+	}
+}
+
+void Bzip2File::buildIndex(FileHandle& fh) {
+	ScanState st(0, 0);
 	off_t uoff = 0;
-	Buffer in, out;
-	BoundList::iterator i = bl.begin(), j = bl.begin();
-	char level = i->level;
-	for (++j; j != bl.end(); ) {
-		if (i->magic != EOSMagic) {
+	if (mResume) {
+		// Start again at the last block we found
+		Bzip2Block *rb = dynamic_cast<Bzip2Block*>(mResume);
+		st = ScanState(rb->coff, rb->level);
+		uoff = rb->uoff;
+	}
+	
+	// Prefer to map the whole file, otherwise read it as we go
+	unique_ptr<MappedFile> map;
+	try {
+		map.reset(new MappedFile(fh, true));
+	} catch (FileHandle::Exception& e) {
+		// ok, we'll read it
+	}
+	const off_t fsz = map ? off_t(map->size()) : fh.size();
+	
+	/* Blocks are independent, so validate each pair of adjacent candidates
+	 * in parallel, a batch at a time. Then walk the results in order. If a
+	 * boundary turns out to be spurious, the block before it must be
+	 * retried against the next candidate, which we do serially.
+	 *
+	 * Only scan far enough ahead for one batch, so blocks become readable
+	 * as we go. The first candidate is always the start of the next block.
+	 *
+	 * Validating uses the work pool that all builds share, so indexing many
+	 * files at once doesn't multiply threads. */
+	unique_ptr<ThreadPool> ownPool;
+	ThreadPool *pool = mWorkPool;
+	if (!pool) {
+		ownPool.reset(new ThreadPool(mIndexThreads));
+		pool = ownPool.get();
+	}
+	const size_t batch = ValidateBatch * pool->size();
+	BoundVec cands;
+	ValidationList results;
+	
+	ConditionVariable cv;
+	size_t remain = 0;
+	ValidateInfo info(*this, fh, cv, remain);
+	
+	char level = 0;
+	while (true) {
+		while (cands.size() <= batch && st.pos < fsz) {
+			BoundList bl;
+			findBlockBoundaryCandidates(fh, map.get(), bl, st,
+				st.pos + ScanChunkSize);
+			cands.insert(cands.end(), bl.begin(), bl.end());
+		}
+		if (cands.size() < 2)
+			break;
+		
+		const size_t e = std::min(batch, cands.size() - 1);
+		results.assign(e, Validation());
+		{
+			Lock lock(cv);
+			for (size_t k = 0; k < e; ++k) {
+				if (cands[k].magic == EOSMagic)
+					continue;
+				++remain;
+				pool->enqueue(new ValidateJob(info, cands[k], cands[k + 1],
+					results[k]));
+			}
+			while (remain)
+				cv.wait();
+		}
+		
+		size_t i = 0;
+		for (size_t j = 1; j <= e; ++j) {
+			if (cands[i].magic == EOSMagic) {
+				i = j;
+				continue;
+			}
 			if (level == 0)
-				level = i->level;
-			//DEBUG("level = %c", level);
-			createAlignedBlock(fh, in, level, i->coff, i->bits, j->coff,
-				j->bits);			
-			try {
-				decompress(in, out);
-			} catch (std::runtime_error& e) { // Boundary spurious, remove it
-				DEBUG("failed! %9lld -- %9lld", i->coff, j->coff);
-				//FileHandle::writeBuf(in, "block.bz2"); exit(-1);
-				bl.erase(j++);
+				level = cands[i].level;
+			
+			Validation v;
+			if (i + 1 == j && results[i].level == level)
+				v = results[i];
+			else // No usable parallel result
+				validate(fh, cands[i], cands[j], level, v);
+			if (!v.ok) { // Boundary spurious, skip it
+				DEBUG("failed! %9lld -- %9lld", cands[i].coff, cands[j].coff);
 				continue;
 			}
-			DEBUG("ok! %9lld -- %9lld", i->coff, j->coff);
-			addBlock(new Bzip2Block(*i, *j, uoff, out.size(), level));
-			uoff += out.size();
-			if (j->magic == EOSMagic)
+			
+			DEBUG("ok! %9lld -- %9lld", cands[i].coff, cands[j].coff);
+			addBlock(new Bzip2Block(cands[i], cands[j], uoff, v.usize, level));
+			uoff += v.usize;
+			if (cands[j].magic == EOSMagic)
 				level = 0;
+			i = j;
 		}
-		++i; ++j;
+		
+		// Candidates up to e are settled, except the start of the next block
+		cands[e] = cands[i];
+		cands.erase(cands.begin(), cands.begin() + e);
 	}
 }
 
 void Bzip2File::decompressBlock(const FileHandle& fh, const Block& b,
 		Buffer& ubuf) const {
-	Buffer in;
 	const Bzip2Block& bb = dynamic_cast<const Bzip2Block&>(b);
-	createAlignedBlock(fh, in, bb.level, bb.coff, bb.bits,
-		bb.coff + bb.csize, bb.endbits);
-	decompress(in, ubuf);
+	
+	// Decoding always checks the block CRC, we just count it
+	try {
+		decodeBlock(fh, bb.level, bb.coff, bb.bits, bb.coff + bb.csize,
+			bb.endbits, ubuf);
+	} catch (Bzip2Decoder::ChecksumError& e) {
+		if (verifying())
+			verifyResult(b, false);
+		throw;
+	}
+	if (verifyWanted())
+		verifyResult(b, true);
 	if (ubuf.size() != bb.usize)
 		throw std::runtime_error("bzip2 block decompresses to wrong size");
 }
 
-std::string Bzip2File::destName() const {
+std::string Bzip2File::destNameFor(const std::string& path) {
 	using namespace PathUtils;
-	std::string base = basename(path());
+	std::string base = basename(path);
 	if (replaceExtension(base, "tbz2", "tar")) return base;
 	if (removeExtension(base, "bz2")) return base;
 	return base;
@@ -255,7 +535,7 @@ bool Bzip2File::readBlock(FileHandle& fh, Block *b) {
 	return true;
 }
 
-void Bzip2File::writeBlock(FileHandle& fh, const Block* b) const {
+void Bzip2File::writeBlock(FileHandle& fh, Block* b) {
 	IndexedCompFile::writeBlock(fh, b);
 	
 	const Bzip2Block* bb = dynamic_cast<const Bzip2Block*>(b);
@@ -264,4 +544,16 @@ void Bzip2File::writeBlock(FileHandle& fh, const Block* b) const {
 	fh.writeBE(bb->level);
 }
 
+uint64_t Bzip2File::packBlock(const Block& b) const {
+	const Bzip2Block& bb = dynamic_cast<const Bzip2Block&>(b);
+	return uint64_t(uint8_t(bb.level)) << 8 | bb.endbits << 4 | bb.bits;
+}
+
+void Bzip2File::unpackBlock(uint64_t aux, Block& b) const {
+	Bzip2Block& bb = dynamic_cast<Bzip2Block&>(b);
+	bb.bits = aux & 0xF;
+	bb.endbits = (aux >> 4) & 0xF;
+	bb.level = char(aux >> 8);
+}
+
 #endif // HAVE_BZIP2
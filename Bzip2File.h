@@ -4,9 +4,12 @@
 #include "lzopfs.h"
 #include "CompressedFile.h"
 #include "FileList.h"
-
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include "TR1.h"
 
 #include <list>
+#include <vector>
 
 class Bzip2File : public IndexedCompFile {
 protected:
@@ -22,6 +25,55 @@ protected:
 			: magic(m), level(l), coff(c), bits(b) { }
 	};
 	typedef std::list<BlockBoundary> BoundList;
+	typedef std::vector<BlockBoundary> BoundVec;
+	
+	// How far a scan for boundaries has got
+	struct ScanState {
+		off_t pos;		// Next byte to scan
+		char level;		// Of the current stream, zero if not yet known
+		off_t levelPos;	// Where the next level byte is, or -1
+		ScanState(off_t p, char l); // From a block, or a stream if no level
+	};
+	
+	// Result of trying to decompress between two candidate boundaries
+	struct Validation {
+		bool ok;
+		char level;
+		size_t usize;
+		Validation() : ok(false), level(0), usize(0) { }
+	};
+	typedef std::vector<Validation> ValidationList;
+	
+	struct ValidateInfo {
+		const Bzip2File& file;
+		const FileHandle& fh;
+		ConditionVariable& cv;
+		size_t& remain;
+		ValidateInfo(const Bzip2File& f, const FileHandle& h,
+			ConditionVariable& pcv, size_t& r)
+			: file(f), fh(h), cv(pcv), remain(r) { }
+	};
+	
+	struct ValidateJob : public ThreadPool::Job {
+		ValidateInfo& info;
+		const BlockBoundary &start, &end;
+		Validation& result;
+		
+		ValidateJob(ValidateInfo& i, const BlockBoundary& s,
+				const BlockBoundary& e, Validation& r)
+			: info(i), start(s), end(e), result(r) { }
+		virtual void operator()();
+	};
+	
+	// How much to scan for boundaries at once. Blocks found are validated
+	// and published before scanning further.
+	static const size_t ScanChunkSize = 1024 * 1024;
+	
+	// How many candidate pairs to validate at once, per thread
+	static const size_t ValidateBatch = 4;
+	
+	// How much of a block to read when checking its header
+	static const size_t HeaderCheckSize = 32 * 1024;
 	
 	struct Bzip2Block : public Block {
 		size_t bits, endbits;
@@ -33,14 +85,35 @@ protected:
 			bits(start.bits), endbits(end.bits), level(lev) { }
 	};
 	
-	void findBlockBoundaryCandidates(FileHandle& fh, BoundList& bl) const;
+	void findBlockBoundaryCandidates(const FileHandle& fh,
+		const MappedFile *map, BoundList& bl, ScanState& st, off_t end) const;
 	void createAlignedBlock(const FileHandle& fh, Buffer& b,
 		char level, off_t coff, size_t bits, off_t end, size_t endbits) const;
 	void decompress(const Buffer& in, Buffer& out) const;
+	void decodeBlock(const FileHandle& fh, char level, off_t coff,
+		size_t bits, off_t end, size_t endbits, Buffer& out) const;
+	bool plausibleBlock(const FileHandle& fh, const BlockBoundary& start,
+		const BlockBoundary& end, char level) const;
+	void validate(const FileHandle& fh, const BlockBoundary& start,
+		const BlockBoundary& end, char level, Validation& result) const;
 	
 	virtual Block* newBlock() const { return new Bzip2Block(); }
+	virtual uint64_t packBlock(const Block& b) const;
+	virtual void unpackBlock(uint64_t aux, Block& b) const;
 	virtual bool readBlock(FileHandle& fh, Block* b);
-	virtual void writeBlock(FileHandle& fh, const Block *b) const;
+	virtual void writeBlock(FileHandle& fh, Block *b);
+	virtual bool canResume() const { return true; }
+	
+	size_t mIndexThreads; // Threads to validate with, without a work pool
+	
+	// The whole file, mapped the first time a block is decoded
+	mutable Mutex mMapMutex;
+	mutable shared_ptr<MappedFile> mMap;
+	mutable bool mMapFailed; // Then read blocks instead
+	
+	shared_ptr<MappedFile> mapping(const FileHandle& fh) const;
+	virtual bool unloadFile();
+	virtual void resetFile();
 
 public:
 	static const char Magic[];
@@ -49,13 +122,17 @@ public:
 	static const uint64_t BlockMagicMask = (1LL << (BlockMagicBytes * 8)) - 1;
 	static const uint64_t EOSMagic = 0x177245385090;
 	
+	static bool sniff(const Buffer& head);
+	static std::string destNameFor(const std::string& path);
 	static CompressedFile* open(const std::string& path, const OpenParams& params)
 		{ return new Bzip2File(path, params); }
 	
 	Bzip2File(const std::string& path, const OpenParams& params)
-		: IndexedCompFile(path, params.indexRoot) { initialize(params.maxBlock); }
+		: IndexedCompFile(path, params.indexRoot),
+		mIndexThreads(params.indexThreads), mMapFailed(false)
+		{ initialize(params.maxBlock); }
 	
-	virtual std::string destName() const;
+	virtual std::string destName() const { return destNameFor(path()); }
 	
 	virtual void decompressBlock(const FileHandle& fh, const Block& b,
 		Buffer& ubuf) const;
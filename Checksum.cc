@@ -0,0 +1,346 @@
+#include "Checksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define CHECKSUM_X86
+	#include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+	#include <arm_acle.h>
+#endif
+
+namespace Checksum {
+
+namespace {
+	const uint32_t CRC32Poly = 0xedb88320;
+	
+	// Tables for slicing-by-8, t[k] advances a byte through k more zeros
+	struct CRC32Table {
+		uint32_t t[8][256];
+		CRC32Table() {
+			for (uint32_t i = 0; i < 256; ++i) {
+				uint32_t c = i;
+				for (size_t k = 0; k < 8; ++k)
+					c = (c & 1) ? (c >> 1) ^ CRC32Poly : (c >> 1);
+				t[0][i] = c;
+			}
+			for (uint32_t i = 0; i < 256; ++i) {
+				for (size_t k = 1; k < 8; ++k) {
+					const uint32_t c = t[k - 1][i];
+					t[k][i] = t[0][c & 0xff] ^ (c >> 8);
+				}
+			}
+		}
+	};
+	const CRC32Table gCRC32Table;
+	
+	const uint32_t BZip2Poly = 0x04c11db7;
+	
+	// Slicing-by-8 again, but most significant bit first
+	struct BZip2Table {
+		uint32_t t[8][256];
+		BZip2Table() {
+			for (uint32_t i = 0; i < 256; ++i) {
+				uint32_t c = i << 24;
+				for (size_t k = 0; k < 8; ++k)
+					c = (c & 0x80000000) ? (c << 1) ^ BZip2Poly : (c << 1);
+				t[0][i] = c;
+			}
+			for (uint32_t i = 0; i < 256; ++i) {
+				for (size_t k = 1; k < 8; ++k) {
+					const uint32_t c = t[k - 1][i];
+					t[k][i] = t[0][c >> 24] ^ (c << 8);
+				}
+			}
+		}
+	};
+	const BZip2Table gBZip2Table;
+	
+	const uint32_t AdlerBase = 65521;
+	const size_t AdlerMax = 5552; // most bytes before the sums can overflow
+	
+	const uint64_t XXPrime1 = 11400714785074694791ULL;
+	const uint64_t XXPrime2 = 14029467366897019727ULL;
+	const uint64_t XXPrime3 = 1609587929392839161ULL;
+	const uint64_t XXPrime4 = 9650029242287828579ULL;
+	const uint64_t XXPrime5 = 2870177450012600261ULL;
+	
+	inline uint32_t readLE32(const uint8_t *p) {
+		return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16)
+			| (uint32_t(p[3]) << 24);
+	}
+	inline uint64_t readLE64(const uint8_t *p) {
+		return uint64_t(readLE32(p)) | (uint64_t(readLE32(p + 4)) << 32);
+	}
+	inline uint32_t readBE32(const uint8_t *p) {
+		return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16)
+			| (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+	}
+	
+	// Slicing-by-8, works anywhere. Takes and returns the inverted CRC.
+	uint32_t crc32Table(uint32_t crc, const uint8_t *p, size_t size) {
+		const uint32_t (*t)[256] = gCRC32Table.t;
+		const uint8_t *e = p + size;
+		for (; e - p >= 8; p += 8) {
+			const uint32_t one = crc ^ readLE32(p);
+			crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff]
+				^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24]
+				^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+		}
+		for (; p < e; ++p)
+			crc = t[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+		return crc;
+	}
+	
+#ifdef CHECKSUM_X86
+	// Folds 64 bytes at a time with carry-less multiplies, then reduces to
+	// 32 bits. See Intel's "Fast CRC Computation for Generic Polynomials
+	// Using PCLMULQDQ". Needs at least 64 bytes, a multiple of 16.
+	__attribute__((target("pclmul,sse4.1")))
+	uint32_t crc32Fold(uint32_t crc, const uint8_t *p, size_t size) {
+		static const uint64_t K1K2[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+		static const uint64_t K3K4[2] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+		static const uint64_t K5K0[2] = { 0x0163cd6124ULL, 0 };
+		static const uint64_t Poly[2] = { 0x01db710641ULL, 0x01f7011641ULL };
+		
+		__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+		x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+		x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+		x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+		x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+		x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+		x0 = _mm_loadu_si128((const __m128i*)K1K2);
+		p += 64;
+		size -= 64;
+		
+		// Four lanes in parallel
+		for (; size >= 64; p += 64, size -= 64) {
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+			x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+			x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+			x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+			x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				_mm_loadu_si128((const __m128i*)(p + 0x00)));
+			x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				_mm_loadu_si128((const __m128i*)(p + 0x10)));
+			x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				_mm_loadu_si128((const __m128i*)(p + 0x20)));
+			x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				_mm_loadu_si128((const __m128i*)(p + 0x30)));
+		}
+		
+		// Fold the lanes together, then any remaining 16-byte pieces
+		x0 = _mm_loadu_si128((const __m128i*)K3K4);
+		__m128i next[3] = { x2, x3, x4 };
+		for (size_t i = 0; i < 3; ++i) {
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, next[i]), x5);
+		}
+		for (; size >= 16; p += 16, size -= 16) {
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1,
+				_mm_loadu_si128((const __m128i*)p)), x5);
+		}
+		
+		// 128 bits to 64
+		x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+		x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+		x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+		x0 = _mm_loadl_epi64((const __m128i*)K5K0);
+		x2 = _mm_srli_si128(x1, 4);
+		x1 = _mm_and_si128(x1, x3);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+		
+		// Barrett reduction to 32 bits
+		x0 = _mm_loadu_si128((const __m128i*)Poly);
+		x2 = _mm_and_si128(x1, x3);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+		x2 = _mm_and_si128(x2, x3);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x1 = _mm_xor_si128(x1, x2);
+		return _mm_extract_epi32(x1, 1);
+	}
+	
+	// Not worth setting up the fold for less
+	const size_t FoldMin = 256;
+	
+	bool haveCLMUL() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("pclmul")
+			&& __builtin_cpu_supports("sse4.1");
+	}
+	const bool gHaveCLMUL = haveCLMUL();
+	
+	// Sums 32 bytes per step: psadbw adds them up for a, and pmaddubsw
+	// weights them by their distance from the end for b. Handles whole
+	// blocks only, and returns the sums reduced.
+	const size_t AdlerBlock = 32;
+	
+	__attribute__((target("ssse3")))
+	inline uint32_t sumLanes(__m128i v) {
+		v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+		v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtsi128_si32(v);
+	}
+	
+	__attribute__((target("ssse3")))
+	void adler32Blocks(uint32_t& a, uint32_t& b, const uint8_t *p,
+			size_t blocks) {
+		const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+			24, 23, 22, 21, 20, 19, 18, 17);
+		const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+			8, 7, 6, 5, 4, 3, 2, 1);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i ones = _mm_set1_epi16(1);
+		
+		while (blocks) {
+			size_t n = AdlerMax / AdlerBlock;
+			if (n > blocks)
+				n = blocks;
+			blocks -= n;
+			
+			// vps collects a as of each block, each adds 32 of itself to b
+			__m128i vps = _mm_setr_epi32(0, 0, 0, a * n);
+			__m128i vb = _mm_setr_epi32(0, 0, 0, b);
+			__m128i va = zero;
+			for (; n; --n, p += AdlerBlock) {
+				const __m128i x1 = _mm_loadu_si128((const __m128i*)p);
+				const __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 16));
+				vps = _mm_add_epi32(vps, va);
+				va = _mm_add_epi32(va, _mm_sad_epu8(x1, zero));
+				va = _mm_add_epi32(va, _mm_sad_epu8(x2, zero));
+				vb = _mm_add_epi32(vb,
+					_mm_madd_epi16(_mm_maddubs_epi16(x1, tap1), ones));
+				vb = _mm_add_epi32(vb,
+					_mm_madd_epi16(_mm_maddubs_epi16(x2, tap2), ones));
+			}
+			vb = _mm_add_epi32(vb, _mm_slli_epi32(vps, 5));
+			
+			a = (a + sumLanes(va)) % AdlerBase;
+			b = sumLanes(vb) % AdlerBase;
+		}
+	}
+	
+	bool haveSSSE3() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("ssse3");
+	}
+	const bool gHaveSSSE3 = haveSSSE3();
+#endif
+	inline uint64_t rotl(uint64_t x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+	inline uint64_t xxRound(uint64_t acc, uint64_t v) {
+		return rotl(acc + v * XXPrime2, 31) * XXPrime1;
+	}
+	inline uint64_t xxMerge(uint64_t acc, uint64_t v) {
+		return (acc ^ xxRound(0, v)) * XXPrime1 + XXPrime4;
+	}
+}
+
+uint32_t crc32(uint32_t crc, const void *buf, size_t size) {
+	const uint8_t *p = static_cast<const uint8_t*>(buf);
+	crc = ~crc;
+#if defined(CHECKSUM_X86)
+	if (gHaveCLMUL && size >= FoldMin) {
+		const size_t n = size & ~size_t(15);
+		crc = crc32Fold(crc, p, n);
+		p += n;
+		size -= n;
+	}
+#elif defined(__ARM_FEATURE_CRC32)
+	for (; size >= 8; p += 8, size -= 8)
+		crc = __crc32d(crc, readLE64(p));
+#endif
+	return ~crc32Table(crc, p, size);
+}
+
+uint32_t bzip2CRC(uint32_t crc, const void *buf, size_t size) {
+	const uint8_t *p = static_cast<const uint8_t*>(buf);
+	const uint32_t (*t)[256] = gBZip2Table.t;
+	const uint8_t *e = p + size;
+	crc = ~crc;
+	for (; e - p >= 8; p += 8) {
+		const uint32_t one = crc ^ readBE32(p);
+		crc = t[7][one >> 24] ^ t[6][(one >> 16) & 0xff]
+			^ t[5][(one >> 8) & 0xff] ^ t[4][one & 0xff]
+			^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+	}
+	for (; p < e; ++p)
+		crc = t[0][(crc >> 24) ^ *p] ^ (crc << 8);
+	return ~crc;
+}
+
+uint32_t adler32(uint32_t adler, const void *buf, size_t size) {
+	const uint8_t *p = static_cast<const uint8_t*>(buf);
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+#ifdef CHECKSUM_X86
+	if (gHaveSSSE3 && size >= 2 * AdlerBlock) {
+		const size_t blocks = size / AdlerBlock;
+		adler32Blocks(a, b, p, blocks);
+		p += blocks * AdlerBlock;
+		size -= blocks * AdlerBlock;
+	}
+#endif
+	while (size) {
+		// Only take the modulus when we must
+		const size_t n = size < AdlerMax ? size : AdlerMax;
+		for (const uint8_t *e = p + n; p < e; ++p) {
+			a += *p;
+			b += a;
+		}
+		a %= AdlerBase;
+		b %= AdlerBase;
+		size -= n;
+	}
+	return (b << 16) | a;
+}
+
+uint64_t xxh64(const void *buf, size_t size, uint64_t seed) {
+	const uint8_t *p = static_cast<const uint8_t*>(buf);
+	const uint8_t *e = p + size;
+	uint64_t h;
+	
+	if (size >= 32) {
+		uint64_t v1 = seed + XXPrime1 + XXPrime2, v2 = seed + XXPrime2,
+			v3 = seed, v4 = seed - XXPrime1;
+		for (; e - p >= 32; p += 32) {
+			v1 = xxRound(v1, readLE64(p));
+			v2 = xxRound(v2, readLE64(p + 8));
+			v3 = xxRound(v3, readLE64(p + 16));
+			v4 = xxRound(v4, readLE64(p + 24));
+		}
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = xxMerge(h, v1);
+		h = xxMerge(h, v2);
+		h = xxMerge(h, v3);
+		h = xxMerge(h, v4);
+	} else {
+		h = seed + XXPrime5;
+	}
+	h += size;
+	
+	for (; e - p >= 8; p += 8)
+		h = rotl(h ^ xxRound(0, readLE64(p)), 27) * XXPrime1 + XXPrime4;
+	if (e - p >= 4) {
+		h = rotl(h ^ (uint64_t(readLE32(p)) * XXPrime1), 23) * XXPrime2
+			+ XXPrime3;
+		p += 4;
+	}
+	for (; p < e; ++p)
+		h = rotl(h ^ (*p * XXPrime5), 11) * XXPrime1;
+	
+	h ^= h >> 33;
+	h *= XXPrime2;
+	h ^= h >> 29;
+	h *= XXPrime3;
+	h ^= h >> 32;
+	return h;
+}
+
+}
@@ -0,0 +1,23 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace Checksum {
+	// Standard CRC-32, as used by zlib and friends. Pass the previous result
+	// to continue a checksum, starting from zero.
+	uint32_t crc32(uint32_t crc, const void *buf, size_t size);
+	
+	// The big-endian CRC-32 that bzip2 uses for its blocks. Also starts from
+	// zero.
+	uint32_t bzip2CRC(uint32_t crc, const void *buf, size_t size);
+	
+	// Adler-32, as used by zlib and lzop. Start from one.
+	uint32_t adler32(uint32_t adler, const void *buf, size_t size);
+	
+	// XXH64, as used by zstd
+	uint64_t xxh64(const void *buf, size_t size, uint64_t seed = 0);
+}
+
+#endif // CHECKSUM_H
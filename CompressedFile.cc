@@ -1,13 +1,25 @@
 #include "CompressedFile.h"
 
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 
+#include "Checksum.h"
 #include "PathUtils.h"
+#include "TR1.h"
 
 #include <inttypes.h>
+#include <unistd.h>
 
 const size_t CompressedFile::ChunkSize = 4096;
 
+uint64_t CompressedFile::nextID() {
+	static Mutex mutex;
+	static uint64_t next = 0;
+	Lock lock(mutex);
+	return ++next;
+}
+
 void CompressedFile::throwFormat(const std::string& s) const {
 	throw FormatException(mPath, s);
 }
@@ -32,6 +44,62 @@ void CompressedFile::checkSizes(uint64_t maxBlock) const {
 	}
 }
 
+bool CompressedFile::load() {
+	Lock lock(mLoadMutex);
+	if (mLoaded)
+		return false;
+	if (!mLoadError.empty()) // Don't try again
+		throw FormatException(path(), mLoadError);
+	
+	// A bad file stays bad, but other errors may be transient, like running
+	// out of descriptors, so the next load tries again
+	try {
+		loadFile();
+	} catch (FormatException& e) {
+		mLoadError = e.what();
+		throw;
+	} catch (std::runtime_error& e) {
+		resetFile();
+		throw;
+	}
+	mLoaded = true;
+	return true;
+}
+
+bool CompressedFile::loaded() const {
+	Lock lock(mLoadMutex);
+	return mLoaded;
+}
+
+bool CompressedFile::unload() {
+	Lock lock(mLoadMutex);
+	if (!mLoaded || !unloadFile())
+		return false;
+	mLoaded = false;
+	
+	// The source may change before we load it again, so don't let its
+	// cached blocks or pooled descriptor be used
+	if (mFilePool)
+		mFilePool->close(mID);
+	mID = nextID();
+	return true;
+}
+
+void CompressedFile::hold() const {
+	Lock lock(mHoldMutex);
+	++mHolds;
+}
+
+void CompressedFile::release() const {
+	Lock lock(mHoldMutex);
+	--mHolds;
+}
+
+bool CompressedFile::held() const {
+	Lock lock(mHoldMutex);
+	return mHolds;
+}
+
 void CompressedFile::dumpBlocks() {
 	fprintf(stderr, "\nBLOCKS\n");
 	for (BlockIterator iter = findBlock(0); !iter.end(); ++iter) {
@@ -42,95 +110,635 @@ void CompressedFile::dumpBlocks() {
 }
 
 void BlockListCompFile::initialize(uint64_t maxBlock) {
+	mMaxBlock = maxBlock;
 	FileHandle fh(path(), O_RDONLY);
 	checkFileType(fh);
+}
 
+void BlockListCompFile::loadFile() {
+	FileHandle fh(path(), O_RDONLY);
 	loadIndex(fh);
+	if (!mPending)
+		checkSizes(mMaxBlock);
+}
+
+// Only a finished index can be dropped, it's easy to load again
+bool BlockListCompFile::unloadFile() {
+	Lock lock(mIndexCond);
+	if (!mComplete || mPending || !mUnready.empty())
+		return false;
+	mUnloadedSize = mBlocks.uncompressedEnd();
+	mBlocks.clear();
+	mComplete = false;
+	return true;
+}
+
+void BlockListCompFile::resetFile() {
+	Lock lock(mIndexCond);
+	BlockList::iterator iter;
+	for (iter = mUnready.begin(); iter != mUnready.end(); ++iter)
+		delete *iter;
+	mUnready.clear();
+	mBlocks.clear();
+	mComplete = mPending = false;
+}
+
+bool BlockListCompFile::quickSize(off_t& size) const {
+	Lock lock(mIndexCond);
+	if (mUnloadedSize < 0)
+		return false;
+	size = mUnloadedSize;
+	return true;
+}
 
-	checkSizes(maxBlock);
+uint64_t BlockListCompFile::indexMemory() const {
+	Lock lock(mIndexCond);
+	return mBlocks.memory();
 }
 
 void BlockListCompFile::loadIndex(FileHandle& fh) {
 	buildIndex(fh);
+	finishIndex();
+}
+
+void BlockListCompFile::buildPending() {
+	mPending = false;
+	try {
+		FileHandle fh(path(), O_RDONLY);
+		buildIndex(fh);
+	} catch (std::runtime_error& e) {
+		fprintf(stderr, "Error indexing file %s, only the first %" PRIu64
+			" bytes are usable: %s\n", path().c_str(),
+			uint64_t(uncompressedSize()), e.what());
+		BlockListCompFile::finishIndex(); // Don't leave readers waiting
+		return;
+	}
+	
+	try {
+		finishIndex();
+		checkSizes(mMaxBlock);
+	} catch (std::runtime_error& e) {
+		fprintf(stderr, "Error indexing file %s: %s\n", path().c_str(),
+			e.what());
+	}
+}
+
+void BlockListCompFile::addBlock(Block* b, bool sized) {
+	mUnready.push_back(b);
+	publishBlocks(mUnready.size() - (sized ? 0 : 1));
+}
+
+void BlockListCompFile::publishBlocks(size_t count) {
+	if (count == 0)
+		return;
+	BlockList::iterator end = mUnready.begin() + count;
+	blocksReady(mUnready.begin(), end);
+	
+	{
+		Lock lock(mIndexCond);
+		for (BlockList::iterator iter = mUnready.begin(); iter != end; ++iter)
+			mBlocks.push_back(**iter, packBlock(**iter));
+		mIndexCond.broadcast();
+	}
+	for (BlockList::iterator iter = mUnready.begin(); iter != end; ++iter)
+		delete *iter;
+	mUnready.erase(mUnready.begin(), end);
 }
 
-namespace {
-struct BlockOffsetOrdering {
-	bool operator()(const Block* b, off_t off) {
-		return (b->uoff + b->usize - 1) < (uint64_t)off;
+void BlockListCompFile::finishIndex() {
+	publishBlocks(mUnready.size());
+	
+	Lock lock(mIndexCond);
+	mBlocks.compact();
+	mComplete = true;
+	mIndexCond.broadcast();
+}
+
+bool BlockListCompFile::block(size_t i, Block& b) const {
+	uint64_t aux;
+	{
+		Lock lock(mIndexCond);
+		if (i >= mBlocks.size())
+			return false;
+		aux = mBlocks.get(i, b);
 	}
+	unpackBlock(aux, b);
+	return true;
+}
 
-	bool operator()(off_t off, const Block* b) {
-		return (uint64_t)off < b->uoff;
+bool BlockListCompFile::indexComplete() const {
+	Lock lock(mIndexCond);
+	return mComplete;
+}
+
+void BlockListCompFile::waitIndexed(off_t off) const {
+	Lock lock(mIndexCond);
+	while (!mComplete) {
+		if (!mBlocks.empty() && mBlocks.uncompressedEnd() >= uint64_t(off))
+			return;
+		mIndexCond.wait();
 	}
-};
 }
 
 BlockListCompFile::BlockIterator BlockListCompFile::findBlock(off_t off) const {
-	BlockList::const_iterator iter = std::lower_bound(
-		mBlocks.begin(), mBlocks.end(), off, BlockOffsetOrdering());
-	if (iter == mBlocks.end())
+	size_t idx;
+	{
+		Lock lock(mIndexCond);
+		idx = mBlocks.find(off);
+		if (idx == BlockTable::npos)
+			throw std::runtime_error("can't find block");
+	}
+	return BlockIterator(new Iterator(this, idx));
+}
+
+size_t BlockListCompFile::findBlocks(off_t off, off_t end, Block *blocks,
+		size_t max) const {
+	Lock lock(mIndexCond);
+	size_t idx = mBlocks.find(off);
+	if (idx == BlockTable::npos)
+		return 0;
+	return mBlocks.span(idx, end, blocks, max);
+}
+
+Block *BlockListCompFile::fullBlock(const Block& b) const {
+	size_t idx;
+	{
+		Lock lock(mIndexCond);
+		idx = mBlocks.find(b.uoff);
+	}
+	unique_ptr<Block> full(newBlock());
+	if (idx == BlockTable::npos || !block(idx, *full))
 		throw std::runtime_error("can't find block");
-	return BlockIterator(new Iterator(iter, mBlocks.end()));
+	return full.release();
 }
 
 BlockListCompFile::~BlockListCompFile() {
 	BlockList::iterator iter;
-	for (iter = mBlocks.begin(); iter != mBlocks.end(); ++iter)
+	for (iter = mUnready.begin(); iter != mUnready.end(); ++iter)
 		delete *iter;
 }
 
 off_t BlockListCompFile::uncompressedSize() const {
-	if (mBlocks.empty())
-		return 0;
-	const Block& b = *mBlocks.back();
-	return b.uoff + b.usize;
+	Lock lock(mIndexCond);
+	return mBlocks.uncompressedEnd();
 }
 
+const char IndexedCompFile::IndexMagic[] = "lzopfsIX";
+const char IndexedCompFile::IndexDoneMagic[] = "lzopfsOK";
+const size_t IndexedCompFile::IndexMagicSize = 8;
+const uint32_t IndexedCompFile::IndexVersion = 3;
+const off_t IndexedCompFile::IndexHeaderSize = IndexMagicSize
+	+ sizeof(uint32_t) + 3 * sizeof(uint64_t) + sizeof(uint32_t);
+const char IndexedCompFile::ImageMagic[] = "lzopfsIM";
+const uint32_t IndexedCompFile::ImageVersion = 2;
+const uint32_t IndexedCompFile::ByteOrderMark = 0x01020304;
+const time_t IndexedCompFile::CheckpointInterval = 10;
+const size_t IndexedCompFile::FingerprintSamples = 16;
+
 void IndexedCompFile::loadIndex(FileHandle &fh) {
-	// Try reading the index
-	bool index = false;
+	off_t resumePos;
+	statSource(fh);
+	
+	if (loadImage(fh)) {
+		finishIndex();
+		return;
+	}
+	
+	// A complete log in place of the image can just be converted
 	{
 		FileHandle idxr;
 		try {
 			idxr.open(indexPath(), O_RDONLY);
+			if (readIndex(idxr, fh, resumePos) == IndexComplete
+					&& convertIndex(idxr, fh)) {
+				finishIndex();
+				return;
+			}
 		} catch (FileHandle::Exception& e) {
-			// ok to fail
+			// ok to fail, we'll just rebuild it
+		}
+		clearBlocks();
+	}
+	
+	// Build it later, writing the index as we go. Open the output now,
+	// so we fail early if we can't write it.
+	mPending = true;
+	mIndexOut.open(partialIndexPath(), O_RDWR | O_CREAT, 0664);
+	mLastCheckpoint = time(NULL);
+	
+	// Maybe an earlier build got part of the way
+	IndexState state = readIndex(mIndexOut, fh, resumePos);
+	if (state == IndexComplete) { // Just never got converted
+		if (convertIndex(mIndexOut, fh)) {
+			mPending = false;
+			mIndexOut.close();
+			unlink(partialIndexPath().c_str());
+			finishIndex();
+			return;
+		}
+		state = IndexInvalid;
+	}
+	if (state == IndexPartial && canResume()) {
+		mResume = newBlock();
+		block(mBlocks.size() - 1, *mResume);
+		{
+			Lock lock(mIndexCond);
+			mBlocks.truncate(mBlocks.size() - 1);
 		}
-		if (idxr.open() && readIndex(idxr))
-			index = true;
+		prepareResume(mIndexOut, mResume);
+		
+		mIndexOut.truncate(resumePos);
+		mIndexOut.seek(resumePos, SEEK_SET);
+		if (mSourceMoved)
+			writeHeader(mIndexOut, fh);
+		mIndexCRC = indexCRC(mIndexOut, 0, IndexHeaderSize, resumePos);
+		mIndexCRCPos = resumePos;
+		fprintf(stderr, "Resuming index of %s from offset %" PRIu64 "\n",
+			path().c_str(), mResume->coff);
+		return;
 	}
+	
+	clearBlocks();
+	mIndexOut.truncate(0);
+	writeHeader(mIndexOut, fh);
+	mIndexCRC = 0;
+	mIndexCRCPos = IndexHeaderSize;
+}
 
-	if (!index) {
-		buildIndex(fh);
-		FileHandle idxw(indexPath(), O_WRONLY | O_CREAT | O_TRUNC, 0664);
-		writeIndex(idxw);
+void IndexedCompFile::statSource(const FileHandle& src) {
+	struct stat st;
+	src.stat(st);
+	mSource.size = st.st_size;
+	mSource.inode = st.st_ino;
+	mSource.mtime = st.st_mtime;
+	mHaveFingerprint = false; // The contents may have changed, too
+}
+
+// CRC of evenly spaced chunks, including the start and end of the file
+uint32_t IndexedCompFile::fingerprint(const FileHandle& src) {
+	if (mHaveFingerprint)
+		return mSource.fingerprint;
+	
+	uint32_t crc = 0;
+	const off_t size = mSource.size;
+	const off_t sampleSize = 4 * ChunkSize;
+	if (size <= off_t(FingerprintSamples) * sampleSize) {
+		crc = indexCRC(src, crc, 0, size);
+	} else {
+		const off_t step = (size - sampleSize) / (FingerprintSamples - 1);
+		for (size_t i = 0; i < FingerprintSamples; ++i)
+			crc = indexCRC(src, crc, i * step, i * step + sampleSize);
+	}
+	
+	mSource.fingerprint = crc;
+	mHaveFingerprint = true;
+	return crc;
+}
+
+bool IndexedCompFile::matchSource(const FileHandle& src,
+		const SourceInfo& info) {
+	mSourceMoved = false;
+	if (info.size != mSource.size)
+		return false;
+	if (info.inode == mSource.inode && info.mtime == mSource.mtime)
+		return true;
+	
+	// Maybe it was copied or touched, check if the contents look the same
+	if (info.fingerprint != fingerprint(src))
+		return false;
+	mSourceMoved = true;
+	return true;
+}
+
+void IndexedCompFile::writeHeader(FileHandle& fh, const FileHandle& src) {
+	fingerprint(src);
+	fh.seek(0, SEEK_SET);
+	fh.write(IndexMagic, IndexMagicSize);
+	fh.writeBE(IndexVersion);
+	fh.writeBE(mSource.size);
+	fh.writeBE(mSource.inode);
+	fh.writeBE(mSource.mtime);
+	fh.writeBE(mSource.fingerprint);
+}
+
+bool IndexedCompFile::loadImage(const FileHandle& src) {
+	unique_ptr<MappedFile> map;
+	try {
+		FileHandle fh(indexPath(), O_RDONLY);
+		map.reset(new MappedFile(fh));
+	} catch (FileHandle::Exception& e) {
+		return false; // ok to fail
+	}
+	
+	ImageHeader hdr;
+	if (map->size() < sizeof(hdr))
+		return false;
+	memcpy(&hdr, map->data(), sizeof(hdr));
+	if (!validHeader(hdr))
+		return false;
+	
+	SourceInfo info;
+	info.size = hdr.size;
+	info.inode = hdr.inode;
+	info.mtime = hdr.mtime;
+	info.fingerprint = hdr.fingerprint;
+	if (!matchSource(src, info)) {
+		fprintf(stderr, "Index %s is out of date, rebuilding\n",
+			indexPath().c_str());
+		return false;
+	}
+	
+	if (hdr.tableOff > map->size() || hdr.tableSize > map->size() - hdr.tableOff)
+		return false;
+	{
+		Lock lock(mIndexCond);
+		if (!mBlocks.attach(map->data() + hdr.tableOff, hdr.tableSize))
+			return false;
+	}
+	mIndexMap.reset(map.release());
+	if (mSourceMoved)
+		updateHeader();
+	return true;
+}
+
+void IndexedCompFile::writeImage(const FileHandle& log) {
+	if (!mHaveFingerprint) {
+		FileHandle src(path(), O_RDONLY);
+		fingerprint(src);
+	}
+	
+	ImageHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	FileHandle out(newIndexPath(), O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	out.write(&hdr, sizeof(hdr)); // Filled in once we're done
+	
+	// Extra data moves to a new place, so blocks must be packed again
+	BlockTable table;
+	unique_ptr<Block> b(newBlock());
+	for (size_t i = 0; block(i, *b); ++i) {
+		copyIndexData(log, out, *b);
+		table.push_back(*b, packBlock(*b));
+	}
+	table.compact();
+	
+	static const uint8_t zeroes[8] = { 0 };
+	if (out.tell() % 8)
+		out.write(zeroes, 8 - out.tell() % 8);
+	hdr.tableOff = out.tell();
+	table.write(out);
+	hdr.tableSize = out.tell() - hdr.tableOff;
+	hdr.usize = table.uncompressedEnd();
+	
+	fillHeader(hdr);
+	out.seek(0, SEEK_SET);
+	out.write(&hdr, sizeof(hdr));
+	out.sync();
+	out.close();
+	if (rename(newIndexPath().c_str(), indexPath().c_str()) != 0)
+		throw FileHandle::Exception("can't rename index " + indexPath(),
+			errno);
+}
+
+// Replace blocks read from a complete log with a finished index
+bool IndexedCompFile::convertIndex(const FileHandle& log,
+		const FileHandle& src) {
+	writeImage(log);
+	clearBlocks();
+	return loadImage(src);
+}
+
+void IndexedCompFile::fillHeader(ImageHeader& hdr) const {
+	memcpy(hdr.magic, ImageMagic, IndexMagicSize);
+	hdr.version = ImageVersion;
+	hdr.byteOrder = ByteOrderMark;
+	hdr.size = mSource.size;
+	hdr.inode = mSource.inode;
+	hdr.mtime = mSource.mtime;
+	hdr.fingerprint = mSource.fingerprint;
+	hdr.crc = 0;
+	hdr.crc = Checksum::crc32(0, &hdr, sizeof(hdr));
+}
+
+bool IndexedCompFile::validHeader(ImageHeader hdr) {
+	uint32_t crc = hdr.crc;
+	hdr.crc = 0;
+	return std::equal(hdr.magic, hdr.magic + IndexMagicSize, ImageMagic)
+		&& hdr.version == ImageVersion && hdr.byteOrder == ByteOrderMark
+		&& crc == Checksum::crc32(0, &hdr, sizeof(hdr));
+}
+
+// Only if the source is clearly unchanged, without a fingerprint
+bool IndexedCompFile::quickSize(off_t& size) const {
+	ImageHeader hdr;
+	struct stat st;
+	try {
+		FileHandle fh(indexPath(), O_RDONLY);
+		if (fh.tryPRead(0, &hdr, sizeof(hdr)) < sizeof(hdr))
+			return false;
+	} catch (FileHandle::Exception& e) {
+		return false;
+	}
+	if (!validHeader(hdr) || stat(path().c_str(), &st) != 0)
+		return false;
+	if (hdr.size != uint64_t(st.st_size) || hdr.inode != uint64_t(st.st_ino)
+			|| hdr.mtime != int64_t(st.st_mtime))
+		return false;
+	size = hdr.usize;
+	return true;
+}
+
+// Record the new identity of the source, so next time we can skip the
+// fingerprint. Not a problem if we can't.
+void IndexedCompFile::updateHeader() {
+	try {
+		ImageHeader hdr;
+		memcpy(&hdr, mIndexMap->data(), sizeof(hdr));
+		fillHeader(hdr);
+		FileHandle idxw(indexPath(), O_WRONLY);
+		idxw.write(&hdr, sizeof(hdr));
+		mSourceMoved = false;
+	} catch (FileHandle::Exception& e) {
+		// ok to fail
+	}
+}
+
+const uint8_t *IndexedCompFile::indexData(uint64_t off, size_t size) const {
+	if (!mIndexMap || off > mIndexMap->size()
+			|| size > mIndexMap->size() - off)
+		throw std::runtime_error("bad data offset in index");
+	return mIndexMap->data() + off;
+}
+
+bool IndexedCompFile::unloadFile() {
+	if (!BlockListCompFile::unloadFile())
+		return false;
+	mIndexMap.reset(); // Nothing borrows from it anymore
+	delete mResume;
+	mResume = 0;
+	mSourceMoved = false;
+	return true;
+}
+
+void IndexedCompFile::resetFile() {
+	BlockListCompFile::resetFile();
+	mIndexOut.close();
+	mIndexMap.reset();
+	delete mResume;
+	mResume = 0;
+	mSourceMoved = false;
+}
+
+uint64_t IndexedCompFile::indexMemory() const {
+	return BlockListCompFile::indexMemory()
+		+ (mIndexMap ? mIndexMap->size() : 0);
+}
+
+void IndexedCompFile::clearBlocks() {
+	Lock lock(mIndexCond);
+	mBlocks.clear();
+}
+
+uint32_t IndexedCompFile::indexCRC(const FileHandle& fh, uint32_t crc,
+		off_t begin, off_t end) {
+	Buffer buf;
+	while (begin < end) {
+		size_t size = std::min(end - begin, off_t(16 * ChunkSize));
+		fh.pread(begin, buf, size);
+		crc = Checksum::crc32(crc, &buf[0], size);
+		begin += size;
+	}
+	return crc;
+}
+
+void IndexedCompFile::writeControl(ControlRecord type) {
+	off_t pos = mIndexOut.tell();
+	mIndexCRC = indexCRC(mIndexOut, mIndexCRC, mIndexCRCPos, pos);
+	mIndexCRCPos = pos;
+	
+	uint32_t control = 0;
+	mIndexOut.writeBE(control);
+	mIndexOut.writeBE(uint8_t(type));
+	mIndexOut.writeBE(mIndexCRC);
+	if (type == ControlEnd)
+		mIndexOut.write(IndexDoneMagic, IndexMagicSize);
+	mIndexOut.sync();
+	mLastCheckpoint = time(NULL);
+}
+
+void IndexedCompFile::blocksReady(BlockList::const_iterator begin,
+		BlockList::const_iterator end) {
+	if (!mIndexOut.open())
+		return; // Index was read, not built
+	for (BlockList::const_iterator iter = begin; iter != end; ++iter) {
+		// Empty blocks are useless, and a zero size marks a control record
+		if ((*iter)->usize)
+			writeBlock(mIndexOut, *iter);
 	}
+	if (time(NULL) - mLastCheckpoint >= CheckpointInterval)
+		writeControl(ControlCheckpoint);
+}
+
+void IndexedCompFile::finishIndex() {
+	BlockListCompFile::finishIndex();
+	if (!mIndexOut.open())
+		return;
+	
+	// Keep using the blocks we have, but write a finished index for next
+	// time. The log is still complete if that fails.
+	writeControl(ControlEnd);
+	writeImage(mIndexOut);
+	mIndexOut.close();
+	unlink(partialIndexPath().c_str());
 }
 
 std::string IndexedCompFile::indexPath() const {
 	return mIndexPath;
 }
 
-bool IndexedCompFile::readIndex(FileHandle& fh) {
-	uint64_t uoff = 0;
-	while (true) {
-		Block* b = 0;
-		try {
-			b = newBlock();
-			if (!readBlock(fh, b)) {
-				delete b;
-//				dumpBlocks();
-				return true;
+std::string IndexedCompFile::partialIndexPath() const {
+	return mIndexPath + ".partial";
+}
+
+std::string IndexedCompFile::newIndexPath() const {
+	return mIndexPath + ".new";
+}
+
+IndexedCompFile::IndexState IndexedCompFile::readIndex(FileHandle& fh,
+		const FileHandle& src, off_t& resumePos) {
+	size_t good = 0;	// Number of blocks with a valid checksum
+	off_t record = 0, goodRecord = 0;
+	try {
+		Buffer magic;
+		fh.seek(0, SEEK_SET);
+		fh.read(magic, IndexMagicSize);
+		if (!std::equal(magic.begin(), magic.end(), IndexMagic))
+			return IndexInvalid;
+		uint32_t version;
+		fh.readBE(version);
+		if (version != IndexVersion)
+			return IndexInvalid;
+		
+		SourceInfo info;
+		fh.readBE(info.size);
+		fh.readBE(info.inode);
+		fh.readBE(info.mtime);
+		fh.readBE(info.fingerprint);
+		if (!matchSource(src, info)) {
+			fprintf(stderr, "Index %s is out of date, rebuilding\n",
+				fh.path().c_str());
+			return IndexInvalid;
+		}
+		
+		uint32_t crc = 0;
+		off_t crcPos = IndexHeaderSize;
+		uint64_t uoff = 0;
+		while (true) {
+			off_t pos = fh.tell();
+			unique_ptr<Block> b(newBlock());
+			if (readBlock(fh, b.get())) {
+				b->uoff = uoff;
+				{
+					Lock lock(mIndexCond);
+					mBlocks.push_back(*b, packBlock(*b));
+				}
+				uoff += b->usize;
+				record = pos;
+				continue;
+			}
+			
+			uint8_t type;
+			uint32_t stored;
+			fh.readBE(type);
+			fh.readBE(stored);
+			crc = indexCRC(fh, crc, crcPos, pos);
+			crcPos = pos;
+			if (stored != crc)
+				break;
+			good = mBlocks.size();
+			goodRecord = record;
+			
+			if (type == ControlEnd) {
+				fh.read(magic, IndexMagicSize);
+				if (std::equal(magic.begin(), magic.end(), IndexDoneMagic))
+					return IndexComplete;
+				break;
+			} else if (type != ControlCheckpoint) {
+				break;
 			}
-			b->uoff = uoff;
-			addBlock(b);
-			uoff += b->usize;
-		} catch (...) {
-			delete b;
-			throw;
 		}
+	} catch (FileHandle::EOFException& e) {
+		// Truncated, use what we can
+	} catch (FormatException& e) {
+		// Written by some other version, use what was checked
+		fprintf(stderr, "%s\n", e.what());
 	}
+	
+	{
+		Lock lock(mIndexCond);
+		mBlocks.truncate(good);
+	}
+	resumePos = goodRecord;
+	return good ? IndexPartial : IndexInvalid;
 }
 
 bool IndexedCompFile::readBlock(FileHandle& fh, Block *b) {
@@ -143,27 +751,23 @@ bool IndexedCompFile::readBlock(FileHandle& fh, Block *b) {
 	return true;
 }
 
-void IndexedCompFile::writeIndex(FileHandle& fh) const {
-	for (BlockList::const_iterator iter = mBlocks.begin();
-			iter != mBlocks.end(); ++iter) {
-		writeBlock(fh, *iter);
-	}
-	uint32_t eof = 0;
-	fh.writeBE(eof);
-//	fprintf(stderr, "Wrote index\n");
-}
-
-void IndexedCompFile::writeBlock(FileHandle& fh, const Block* b) const {
+void IndexedCompFile::writeBlock(FileHandle& fh, Block* b) {
 	fh.writeBE(b->usize);
 	fh.writeBE(b->csize);
 	fh.writeBE(b->coff);
 }
 
 IndexedCompFile::IndexedCompFile(const std::string& path, const std::string& indexRoot)
-		: BlockListCompFile(path) {
+		: BlockListCompFile(path), mHaveFingerprint(false),
+		mSourceMoved(false), mIndexCRC(0), mIndexCRCPos(0),
+		mLastCheckpoint(0), mResume(0) {
 	if (indexRoot.empty()) {
 		mIndexPath = path + ".blockIdx";
 	} else {
 		mIndexPath = indexRoot + "/" + PathUtils::basename(path) + ".blockIdx";
 	}
-}
\ No newline at end of file
+}
+
+IndexedCompFile::~IndexedCompFile() {
+	delete mResume;
+}
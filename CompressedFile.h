@@ -2,11 +2,20 @@
 #define COMPRESSEDFILE_H
 
 #include "lzopfs.h"
+#include "BlockTable.h"
 #include "FileHandle.h"
+#include "FilePool.h"
+#include "MappedFile.h"
+#include "MemoryBudget.h"
+#include "ThreadPool.h"
+#include "TR1.h"
+#include "Verifier.h"
 
 #include <algorithm>
 #include <string>
 
+#include <time.h>
+
 class CompressedFile {
 public:
 	static const size_t ChunkSize; // for input buffers
@@ -49,87 +58,312 @@ public:
 
 protected:
 	std::string mPath;
+	uint64_t mID;
+	Verifier *mVerifier;
+	MemoryBudget *mBudget; // For decoder memory, null if unlimited
+	FilePool *mFilePool; // For reading, null to open our own
+	ThreadPool *mWorkPool; // For work within a build, null to make our own
+	
+	mutable Mutex mLoadMutex;
+	bool mLoaded;
+	std::string mLoadError; // Why the format was bad, if it was
+	
+	mutable Mutex mHoldMutex;
+	mutable size_t mHolds;
+	
+	static uint64_t nextID();
+	virtual void loadFile() { }
+	virtual bool unloadFile() { return false; } // False if it can't
+	virtual void resetFile() { } // Forget a load that failed part way
 
 	virtual void throwFormat(const std::string& s) const;
 	virtual void checkSizes(uint64_t maxBlock) const;
+	
+	// Helpers for checking decompressed blocks
+	bool verifying() const
+		{ return mVerifier && mVerifier->mode() != Verifier::Off; }
+	bool verifyWanted() const { return mVerifier && mVerifier->wanted(); }
+	void verifyResult(const Block& b, bool ok) const
+		{ mVerifier->checked(ok, mPath, b.uoff); }
+	void verifyUnavailable() const { mVerifier->unavailable(); }
 
 public:
-	CompressedFile(const std::string& path) : mPath(path) { }
-	virtual ~CompressedFile() { }
+	CompressedFile(const std::string& path)
+		: mPath(path), mID(nextID()), mVerifier(0), mBudget(0),
+		mFilePool(0), mWorkPool(0), mLoaded(false), mHolds(0) { }
+	virtual ~CompressedFile() {
+		if (mFilePool)
+			mFilePool->close(mID);
+	}
 
 	virtual const std::string& path() const { return mPath; }
+	
+	// Unique for as long as we run, unlike the address of a file that
+	// might be deleted and replaced. Changes when the file is unloaded.
+	uint64_t id() const { return mID; }
 	virtual std::string destName() const;
+	
+	void verifier(Verifier *v) { mVerifier = v; }
+	void memoryBudget(MemoryBudget *b) { mBudget = b; }
+	void filePool(FilePool *p) { mFilePool = p; }
+	FilePool *filePool() const { return mFilePool; }
+	void workPool(ThreadPool *p) { mWorkPool = p; }
+	
+	/* Constructing a file only checks that it's the right format. Its index
+	 * isn't loaded until load() is called, before anything else is used.
+	 * Returns true if this call did the loading, and throws if it fails.
+	 * Once a load finds the file is bad, later ones fail without trying. */
+	bool load();
+	bool loaded() const;
+	
+	// Drop the index to save memory, so the next load() loads it again.
+	// Only for files that nothing holds. Returns false if it can't.
+	bool unload();
+	
+	// Roughly how much memory the index uses, including any mapping
+	virtual uint64_t indexMemory() const { return 0; }
+	
+	// Get the size without loading, if that's cheap
+	virtual bool quickSize(off_t& size) const { return false; }
+	
+	// A file may be removed while it's in use, so anything using it holds
+	// it. It's only deleted once nothing does.
+	void hold() const;
+	void release() const;
+	bool held() const;
 
 	virtual BlockIterator findBlock(off_t off) const = 0;
+	
+	/* A faster lookup for reads, that doesn't allocate. Fills in up to max
+	 * blocks covering [off, end), returning how many. These only have the
+	 * basic block fields, get a full block with fullBlock() before
+	 * decompressing. */
+	virtual size_t findBlocks(off_t off, off_t end, Block *blocks,
+		size_t max) const = 0;
+	virtual Block *fullBlock(const Block& b) const = 0;
 
 	virtual void decompressBlock(const FileHandle& fh, const Block& b,
 		Buffer& ubuf) const = 0;
 
 	virtual off_t uncompressedSize() const = 0;
+	
+	// Indexes may be built in the background, while blocks below the
+	// indexed frontier are already usable. Until the index is complete,
+	// uncompressedSize() is just the size of the indexed part.
+	virtual bool indexComplete() const { return true; }
+	virtual bool indexPending() const { return false; } // needs buildPending
+	virtual void buildPending() { }
+	
+	// Wait until everything before off is indexed, or the index is complete
+	virtual void waitIndexed(off_t off) const { }
 
 	void dumpBlocks();
 };
 
 class BlockListCompFile: public CompressedFile {
 public:
-	BlockListCompFile(const std::string& path) : CompressedFile(path) { }
+	BlockListCompFile(const std::string& path) : CompressedFile(path),
+		mMaxBlock(0), mComplete(false), mPending(false), mUnloadedSize(-1) { }
 	virtual ~BlockListCompFile();
 
 protected:
 	typedef std::vector<Block*> BlockList;
-	BlockList mBlocks;
-
+	
+	// Blocks that were added, but aren't usable yet. Only the indexing
+	// thread touches these.
+	BlockList mUnready;
+	uint64_t mMaxBlock;
+	
+	mutable ConditionVariable mIndexCond; // protects everything below
+	BlockTable mBlocks;	// Usable blocks, only the indexing thread adds them
+	bool mComplete;
+	bool mPending;		// Index should be built by buildPending()
+	off_t mUnloadedSize; // Before the index was unloaded, if it was
+
+	// Holds a copy of the current block, of whatever type newBlock() makes
 	class Iterator : public BlockIteratorInner {
-		BlockList::const_iterator mIter, mEnd;
+		const BlockListCompFile *mFile;
+		size_t mIdx;
+		Block *mBlock;
+		bool mEnd;
+		
+		Iterator(const Iterator&);
+		Iterator& operator=(const Iterator&);
 	public:
-		Iterator(BlockList::const_iterator i, BlockList::const_iterator e)
-			: mIter(i), mEnd(e) { }
-		virtual void incr() { ++mIter; }
-		virtual const Block& deref() const { return **mIter; }
-		virtual bool end() const { return mIter == mEnd; }
+		Iterator(const BlockListCompFile *f, size_t i)
+			: mFile(f), mIdx(i), mBlock(f->newBlock()),
+			mEnd(!f->block(i, *mBlock)) { }
+		virtual ~Iterator() { delete mBlock; }
+		virtual void incr() { mEnd = !mFile->block(++mIdx, *mBlock); }
+		virtual const Block& deref() const { return *mBlock; }
+		virtual bool end() const { return mEnd; }
 		virtual BlockIteratorInner *dup() const
-			{ return new Iterator(mIter, mEnd); }
+			{ return new Iterator(mFile, mIdx); }
 	};
+	
+	bool block(size_t i, Block& b) const; // False if not indexed (yet)
+	
+	/* Blocks are kept compactly in a BlockTable, so any fields a subclass
+	 * adds must be packed into 64 bits of auxiliary data, and unpacked into
+	 * a block from newBlock(). */
+	virtual Block* newBlock() const { return new Block(); }
+	virtual uint64_t packBlock(const Block& b) const { return 0; }
+	virtual void unpackBlock(uint64_t aux, Block& b) const { }
 
-	virtual void initialize(uint64_t maxBlock);
+	virtual void initialize(uint64_t maxBlock); // Just checks the type
+	virtual void loadFile();
+	virtual bool unloadFile();
+	virtual void resetFile();
 
 	virtual void checkFileType(FileHandle &fh) = 0;
 	virtual void loadIndex(FileHandle &fh);
 	virtual void buildIndex(FileHandle& fh) = 0;
-
-	void addBlock(Block* b) { mBlocks.push_back(b); }
+	
+	// Add a block to the index. If it's not sized, its usize and csize
+	// may still change, so it won't be usable until another block is added
+	// or the index is finished.
+	void addBlock(Block* b, bool sized = true);
+	void publishBlocks(size_t count); // The first count unready blocks
+	virtual void finishIndex();
+	
+	// Called on the indexing thread when blocks become usable
+	virtual void blocksReady(BlockList::const_iterator begin,
+		BlockList::const_iterator end) { }
+	
 	virtual BlockIterator findBlock(off_t off) const;
+	virtual size_t findBlocks(off_t off, off_t end, Block *blocks,
+		size_t max) const;
+	virtual Block *fullBlock(const Block& b) const;
 	virtual off_t uncompressedSize() const;
+
+public:
+	virtual bool quickSize(off_t& size) const;
+	virtual uint64_t indexMemory() const;
+	
+	virtual bool indexComplete() const;
+	virtual bool indexPending() const { return mPending; }
+	virtual void buildPending();
+	virtual void waitIndexed(off_t off) const;
 };
 
+/* While an index is built, it's written as a log: a header describing the
+ * source file, followed by block records. Every so often there's a
+ * checkpoint record with a CRC of all the records before it, so a partial
+ * log can be trusted up to its last checkpoint. A complete log ends with an
+ * end record and a marker.
+ *
+ * A finished index is converted to an image instead: a header, then any
+ * extra data blocks refer to, then a BlockTable image. It's all in native
+ * byte order, so it can be used in place from a memory map, without reading
+ * any blocks. Complete logs are converted whenever they're found. Indexes
+ * from older versions have a different log format, so they're rebuilt. */
 class IndexedCompFile : public BlockListCompFile {
 public:
 	IndexedCompFile(const std::string& path, const std::string& indexRoot);
+	virtual ~IndexedCompFile();
+	
+	// From the header of a finished index
+	virtual bool quickSize(off_t& size) const;
+	virtual uint64_t indexMemory() const;
 
 protected:
-	std::string mIndexPath;
-
-	class Iterator : public BlockIteratorInner {
-		BlockList::const_iterator mIter, mEnd;
-	public:
-		Iterator(BlockList::const_iterator i, BlockList::const_iterator e)
-			: mIter(i), mEnd(e) { }
-		virtual void incr() { ++mIter; }
-		virtual const Block& deref() const { return **mIter; }
-		virtual bool end() const { return mIter == mEnd; }
-		virtual BlockIteratorInner *dup() const
-			{ return new Iterator(mIter, mEnd); }
+	enum IndexState { IndexInvalid, IndexPartial, IndexComplete };
+	enum ControlRecord { ControlEnd = 0, ControlCheckpoint = 1 };
+	
+	struct ImageHeader {
+		char magic[8];
+		uint32_t version, byteOrder;
+		uint64_t size, inode;	// Same as SourceInfo
+		int64_t mtime;
+		uint32_t fingerprint;
+		uint32_t crc;			// Of the header, with this field zero
+		uint64_t tableOff, tableSize;
+		uint64_t usize;			// Of the source, uncompressed
 	};
-
+	
+	// What the index was built from
+	struct SourceInfo {
+		uint64_t size, inode;
+		int64_t mtime;
+		uint32_t fingerprint; // CRC of a sample of the contents
+		SourceInfo() : size(0), inode(0), mtime(0), fingerprint(0) { }
+	};
+	
+	static const char IndexMagic[];
+	static const char IndexDoneMagic[];
+	static const size_t IndexMagicSize;
+	static const uint32_t IndexVersion;
+	static const char ImageMagic[];
+	static const uint32_t ImageVersion;
+	static const uint32_t ByteOrderMark;
+	static const off_t IndexHeaderSize;
+	static const time_t CheckpointInterval; // in seconds
+	static const size_t FingerprintSamples;
+	
+	SourceInfo mSource;
+	bool mHaveFingerprint;
+	bool mSourceMoved; // Index matches, but its header needs updating
+	
+	std::string mIndexPath;
+	FileHandle mIndexOut; // Where a new index is being written
+	uint32_t mIndexCRC;	// Checksum of mIndexOut up to mIndexCRCPos
+	off_t mIndexCRCPos;
+	time_t mLastCheckpoint;
+	
+	// Last block of a partial index, to resume building from
+	Block *mResume;
+	
+	unique_ptr<MappedFile> mIndexMap; // A finished index we're using
+	
 	virtual std::string indexPath() const;
+	virtual std::string partialIndexPath() const;
+	virtual std::string newIndexPath() const;
 
 	virtual void loadIndex(FileHandle &fh);
-
-	virtual bool readIndex(FileHandle& fh); // True on success
-	virtual void writeIndex(FileHandle& fh) const;
-	virtual Block* newBlock() const { return new Block(); }
-	virtual bool readBlock(FileHandle& fh, Block* b);	// True unless EOF
-	virtual void writeBlock(FileHandle& fh, const Block *b) const;
+	virtual bool unloadFile();
+	virtual void resetFile();
+	virtual void blocksReady(BlockList::const_iterator begin,
+		BlockList::const_iterator end);
+	virtual void finishIndex();
+	
+	void clearBlocks();
+	static uint32_t indexCRC(const FileHandle& fh, uint32_t crc, off_t begin,
+		off_t end);
+	void writeControl(ControlRecord type);
+	
+	void statSource(const FileHandle& src);
+	uint32_t fingerprint(const FileHandle& src);
+	bool matchSource(const FileHandle& src, const SourceInfo& info);
+	void writeHeader(FileHandle& fh, const FileHandle& src);
+	
+	// Load a finished index, or write one from a complete log
+	bool loadImage(const FileHandle& src);
+	void writeImage(const FileHandle& log);
+	bool convertIndex(const FileHandle& log, const FileHandle& src);
+	void fillHeader(ImageHeader& hdr) const;
+	static bool validHeader(ImageHeader hdr);
+	void updateHeader();
+	
+	// Extra data in a finished index, that blocks refer to
+	const uint8_t *indexData(uint64_t off, size_t size) const;
+	
+	// Move any extra data for b from the log to a finished index, and
+	// point b at its new location
+	virtual void copyIndexData(const FileHandle& log, FileHandle& out,
+		Block& b) const { }
+	
+	// Reads blocks from an index of src, keeping only those covered by a
+	// valid checksum. Sets resumePos to the start of the last kept block's
+	// record.
+	virtual IndexState readIndex(FileHandle& fh, const FileHandle& src,
+		off_t& resumePos);
+	virtual bool readBlock(FileHandle& fh, Block* b); // False at a control
+	virtual void writeBlock(FileHandle& fh, Block *b);
+	
+	// Can buildIndex() start again from mResume? If so, this may load
+	// anything it needs from the partial index.
+	virtual bool canResume() const { return false; }
+	virtual void prepareResume(const FileHandle& idx, Block *b) { }
 };
 
 #endif // COMPRESSEDFILE_H
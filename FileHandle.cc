@@ -112,6 +112,21 @@ off_t FileHandle::seek(off_t offset, int whence) {
 	return ret;
 }
 
+void FileHandle::stat(struct stat& st) const {
+	if (::fstat(mFD, &st) != 0)
+		THROW_EX("fstat");
+}
+
+void FileHandle::truncate(off_t size) {
+	if (::ftruncate(mFD, size) != 0)
+		THROW_EX("ftruncate");
+}
+
+void FileHandle::sync() {
+	if (::fsync(mFD) != 0)
+		THROW_EX("fsync");
+}
+
 off_t FileHandle::tell() const {
 	return const_cast<FileHandle*>(this)->seek(0, SEEK_CUR);
 }
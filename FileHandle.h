@@ -7,6 +7,7 @@
 #include <string>
 
 #include <fcntl.h>
+#include <sys/stat.h>
 
 class FileHandle {
 protected:
@@ -42,6 +43,8 @@ public:
 	FileHandle& operator=(const FileHandle& o);
 	
 	bool open() const { return mFD != -1; }
+	int fd() const { return mFD; }
+	const std::string& path() const { return mPath; }
 	
 	void read(void *buf, size_t size);
 	void read(Buffer& buf, size_t size);
@@ -58,6 +61,9 @@ public:
 	off_t seek(off_t offset, int whence = SEEK_CUR);
 	off_t tell() const;
 	off_t size() const;
+	void stat(struct stat& st) const;
+	void truncate(off_t size);
+	void sync();
 	
 	template <typename T>
 	static void convertBE(T &t) {
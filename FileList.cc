@@ -1,6 +1,11 @@
 #include "FileList.h"
 
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+
+#include <dirent.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_LZO
 #include "LzopFile.h"
@@ -15,51 +20,318 @@
 #include "PixzFile.h"
 #endif
 #ifdef HAVE_ZSTD
+#include "ZstdContext.h"
 #include "ZstdFile.h"
 #endif
 
-const FileList::OpenerList FileList::Openers(initOpeners());
+const FileList::FormatList FileList::Formats(initFormats());
+const size_t FileList::SniffSize = 16;
+
+#define FORMAT(_cls) { _cls::sniff, _cls::destNameFor, _cls::open }
 
-FileList::OpenerList FileList::initOpeners() {
-	OpenFunc o[] = {
+FileList::FormatList FileList::initFormats() {
+	Format f[] = {
 #ifdef HAVE_LZO
-		LzopFile::open,
+		FORMAT(LzopFile),
 #endif
 #ifdef HAVE_ZLIB
-		GzipFile::open,
+		FORMAT(GzipFile),
 #endif
 #ifdef HAVE_BZIP2
-		Bzip2File::open,
+		FORMAT(Bzip2File),
 #endif
 #ifdef HAVE_LZMA
-		PixzFile::open,
+		FORMAT(PixzFile),
 #endif
 #ifdef HAVE_ZSTD
-		ZstdFile::open,
+		FORMAT(ZstdFile),
 #endif
 	};
-	return OpenerList(o, o + sizeof(o)/sizeof(o[0]));
+	return FormatList(f, f + sizeof(f)/sizeof(f[0]));
 }
 
-CompressedFile *FileList::find(const std::string& dest) {
-	Map::iterator found = mMap.find(dest);
-	if (found == mMap.end())
+#undef FORMAT
+
+namespace {
+	// Like mkdir -p, but it's fine if we can't
+	void makeDirs(const std::string& path) {
+		for (size_t pos = 1; pos != std::string::npos; ) {
+			pos = path.find('/', pos + 1);
+			mkdir(path.substr(0, pos).c_str(), 0775);
+		}
+	}
+	
+	void splitPath(const std::string& dest, std::string& parent,
+			std::string& name) {
+		size_t slash = dest.rfind('/');
+		parent = slash ? dest.substr(0, slash) : "/";
+		name = dest.substr(slash + 1);
+	}
+}
+
+bool FileList::lookup(const std::string& dest, Entry& entry) {
+	entry.reset();
+	entry.mList = this;
+	Lock lock(mListMutex);
+	if (!mirroring()) {
+		if (dest == "/") {
+			entry.dir = true;
+			return true;
+		}
+		Map::iterator found = mMap.find(dest);
+		if (found == mMap.end())
+			return false;
+		entry.file = found->second;
+		entry.file->hold();
+		return true;
+	}
+	
+	if (dest == "/") {
+		entry.dir = dir(dest);
+		return entry.dir;
+	}
+	
+	std::string parent, name;
+	splitPath(dest, parent, name);
+	Dir *d = dir(parent);
+	if (!d)
+		return false;
+	NodeMap::iterator found = d->nodes.find(name);
+	if (found == d->nodes.end())
+		return false;
+	
+	entry.inode = found->second.inode;
+	entry.dir = found->second.dir;
+	if (!entry.dir && (entry.file = openNode(*d, name, parent)))
+		entry.file->hold();
+	return entry.dir || entry.file;
+}
+
+// Find a dest directory, scanning it and its parents as needed
+FileList::Dir *FileList::dir(const std::string& dest) {
+	DirMap::iterator found = mDirs.find(dest);
+	if (found == mDirs.end()) {
+		std::string source;
+		if (dest == "/") {
+			source = mMirror;
+		} else {
+			std::string parent, name;
+			splitPath(dest, parent, name);
+			Dir *p = dir(parent);
+			if (!p)
+				return 0;
+			NodeMap::iterator n = p->nodes.find(name);
+			if (n == p->nodes.end() || !n->second.dir)
+				return 0;
+			source = n->second.source;
+		}
+		found = mDirs.insert(std::make_pair(dest, Dir())).first;
+		found->second.source = source;
+	}
+	
+	// Dirs are never removed, so this stays valid while we're unlocked
+	Dir& d = found->second;
+	const std::string source = d.source;
+	struct stat st;
+	bool isDir;
+	{
+		Unlock unlock(mListMutex);
+		isDir = stat(source.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+	}
+	if (!isDir)
 		return 0;
-	return found->second;
+	if (d.scanned && st.st_mtime == d.mtime)
+		return &d;
+	
+	const unsigned scans = d.scans;
+	NodeMap nodes;
+	{
+		Unlock unlock(mListMutex);
+		scan(source, nodes);
+	}
+	// If someone else finished a scan meanwhile, theirs is as fresh
+	if (d.scans == scans) {
+		d.mtime = st.st_mtime;
+		d.scanned = true;
+		replaceNodes(d, nodes);
+	}
+	return &d;
 }
 
-void FileList::add(const std::string& source) {
-	CompressedFile *file = 0;
-	try {
-		OpenerList::const_iterator iter;
-		for (iter = Openers.begin(); iter != Openers.end(); ++iter) {
+// Find what's in a source directory. Nothing here touches the list.
+void FileList::scan(const std::string& source, NodeMap& nodes) {
+	DIR *dh = opendir(source.c_str());
+	if (!dh) {
+		fprintf(stderr, "Can't read directory %s: %s\n", source.c_str(),
+			strerror(errno));
+	}
+	
+	struct dirent *ent;
+	while (dh && (ent = readdir(dh))) {
+		std::string name(ent->d_name);
+		if (name == "." || name == "..")
+			continue;
+		
+		Node n;
+		n.source = source + "/" + name;
+		struct stat st;
+		if (stat(n.source.c_str(), &st) != 0)
+			continue;
+		n.inode = st.st_ino;
+		if (S_ISDIR(st.st_mode)) {
+			n.dir = true;
+		} else if (S_ISREG(st.st_mode)) {
+			// Only compressed files show up
+			Buffer head;
 			try {
-				file = (*iter)(source, mOpenParams);
-				break;
-			} catch (CompressedFile::FormatException& e) {
-				// just keep going
+				readHead(n.source, head);
+			} catch (std::runtime_error& e) {
+				continue;
+			}
+			FormatList::const_iterator iter;
+			for (iter = Formats.begin(); iter != Formats.end(); ++iter) {
+				if (iter->sniff(head))
+					break;
 			}
+			if (iter == Formats.end())
+				continue;
+			n.format = &*iter;
+			name = n.format->name(n.source);
+		} else {
+			continue;
+		}
+		
+		if (!nodes.insert(std::make_pair(name, n)).second) {
+			fprintf(stderr, "Skipping %s, it has the same name as another "
+				"file\n", n.source.c_str());
+		}
+	}
+	if (dh)
+		closedir(dh);
+}
+
+// Use newly scanned nodes, keeping any files that are still the same
+void FileList::replaceNodes(Dir& d, NodeMap& nodes) {
+	for (NodeMap::iterator iter = nodes.begin(); iter != nodes.end();
+			++iter) {
+		Node& n = iter->second;
+		NodeMap::iterator old = d.nodes.find(iter->first);
+		if (old != d.nodes.end() && old->second.source == n.source
+				&& old->second.inode == n.inode) {
+			n.file = old->second.file;
+			old->second.file = 0;
 		}
+	}
+	for (NodeMap::iterator iter = d.nodes.begin(); iter != d.nodes.end();
+			++iter) {
+		if (iter->second.file)
+			mRetired.push_back(iter->second.file);
+	}
+	d.nodes.swap(nodes);
+	++d.scans;
+	reap();
+}
+
+// Indexes go in a matching subdirectory of the index root, so files with
+// the same name in different directories don't clash
+CompressedFile *FileList::openNode(Dir& d, const std::string& name,
+		const std::string& destDir) {
+	NodeMap::iterator found = d.nodes.find(name);
+	const Node n = found->second;
+	if (n.file || !n.format)
+		return n.file;
+	
+	CompressedFile *file = 0;
+	{
+		Unlock unlock(mListMutex);
+		OpenParams params(mOpenParams);
+		if (!params.indexRoot.empty() && destDir != "/") {
+			params.indexRoot += destDir;
+			makeDirs(params.indexRoot);
+		}
+		try {
+			file = n.format->open(n.source, params);
+			adopt(file);
+		} catch (std::runtime_error& e) {
+			fprintf(stderr, "Error reading file %s, skipping: %s\n",
+				n.source.c_str(), e.what());
+		}
+	}
+	
+	// The directory may have been scanned again, or someone else may have
+	// opened the file first
+	found = d.nodes.find(name);
+	if (found == d.nodes.end() || found->second.file) {
+		delete file;
+		return found == d.nodes.end() ? 0 : found->second.file;
+	}
+	if (found->second.source != n.source || found->second.inode != n.inode) {
+		delete file;
+		return openNode(d, name, destDir); // It's a different file now
+	}
+	if (file)
+		found->second.file = file;
+	else
+		found->second.format = 0; // Don't try again until it changes
+	return file;
+}
+
+void FileList::mirror(const std::string& source) {
+	struct stat st;
+	if (stat(source.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+		throw std::runtime_error("can't mirror " + source
+			+ ", it's not a directory");
+	mMirror = source;
+}
+
+void FileList::readHead(const std::string& source, Buffer& head) {
+	FileHandle fh(source, O_RDONLY);
+	fh.tryRead(head, SniffSize);
+}
+
+void FileList::adopt(CompressedFile *file) {
+	file->verifier(&mVerifier);
+	file->memoryBudget(&mBudget);
+	file->filePool(&mFilePool);
+}
+
+void FileList::loadDicts() {
+#ifdef HAVE_ZSTD
+	ZstdDictSet::shared().load(mOpenParams.zstdDicts);
+#endif
+}
+
+// Try the formats whose sniff result matches
+CompressedFile *FileList::open(const std::string& source, bool sniffed,
+		const Buffer& head) {
+	FormatList::const_iterator iter;
+	for (iter = Formats.begin(); iter != Formats.end(); ++iter) {
+		if (iter->sniff(head) != sniffed)
+			continue;
+		try {
+			return iter->open(source, mOpenParams);
+		} catch (CompressedFile::FormatException& e) {
+			// just keep going
+		}
+	}
+	return 0;
+}
+
+// Null if it's not a format we understand
+CompressedFile *FileList::openSource(const std::string& source) {
+	Buffer head;
+	readHead(source, head);
+	CompressedFile *file = open(source, true, head);
+	if (!file && mOpenParams.probeFormats)
+		file = open(source, false, head);
+	if (file)
+		adopt(file);
+	return file;
+}
+
+void FileList::add(const std::string& source) {
+	try {
+		CompressedFile *file = openSource(source);
 		if (!file) {
 			fprintf(stderr, "Don't understand format of file %s, skipping.\n",
 				source.c_str());
@@ -75,8 +347,263 @@ void FileList::add(const std::string& source) {
 	}
 }
 
+void FileList::addLater(const std::string& source) {
+	if (mirroring())
+		throw std::runtime_error("can't add files while mirroring");
+	std::string path = PathUtils::realpath(source);
+	{
+		Lock lock(mListMutex);
+		mAdding.insert(path);
+	}
+	
+	{
+		Lock lock(mMutex);
+		if (mIndexPool) {
+			mIndexPool->enqueue(new AddJob(*this, path));
+			return;
+		}
+	}
+	publish(path); // Nowhere to do it in the background yet
+}
+
+// Load and index a file, and only then make it visible
+void FileList::publish(const std::string& source) {
+	CompressedFile *file = 0;
+	try {
+		file = openSource(source);
+		if (!file)
+			throw std::runtime_error("don't understand its format");
+		if (file->load() && file->indexPending())
+			build(file);
+	} catch (std::runtime_error& e) {
+		fprintf(stderr, "Error adding file %s: %s\n", source.c_str(),
+			e.what());
+		delete file;
+		file = 0;
+	}
+	
+	Lock lock(mListMutex);
+	mAdding.erase(mAdding.find(source));
+	if (!file)
+		return;
+	std::string dest("/");
+	dest.append(file->destName());
+	Map::iterator found = mMap.find(dest);
+	if (found != mMap.end())
+		mRetired.push_back(found->second);
+	mMap[dest] = file;
+	touchLocked(file);
+	reap();
+	fprintf(stderr, "Added %s as %s\n", source.c_str(), dest.c_str());
+}
+
+bool FileList::remove(const std::string& name) {
+	if (mirroring())
+		return false;
+	std::string dest(name);
+	if (dest.empty() || dest[0] != '/')
+		dest.insert(0, "/");
+	
+	Lock lock(mListMutex);
+	Map::iterator found = mMap.find(dest);
+	if (found == mMap.end()) {
+		for (found = mMap.begin(); found != mMap.end(); ++found) {
+			if (found->second->path() == name)
+				break;
+		}
+		if (found == mMap.end())
+			return false;
+	}
+	
+	mRetired.push_back(found->second);
+	mMap.erase(found);
+	reap();
+	return true;
+}
+
+std::vector<std::string> FileList::adding() const {
+	Lock lock(mListMutex);
+	return std::vector<std::string>(mAdding.begin(), mAdding.end());
+}
+
+void FileList::release(const CompressedFile *file) {
+	file->release();
+	collect();
+}
+
+void FileList::collect() {
+	Lock lock(mListMutex);
+	if (!mRetired.empty())
+		reap();
+}
+
+void FileList::reap() {
+	std::vector<CompressedFile*> keep;
+	for (size_t i = 0; i < mRetired.size(); ++i) {
+		if (mRetired[i]->held()) {
+			keep.push_back(mRetired[i]);
+		} else {
+			forget(mRetired[i]);
+			delete mRetired[i];
+		}
+	}
+	mRetired.swap(keep);
+}
+
+// A file was just used, and its index may have changed size
+void FileList::touch(CompressedFile *file) {
+	if (!mOpenParams.indexMemory)
+		return;
+	Lock lock(mListMutex);
+	touchLocked(file);
+}
+
+void FileList::touchLocked(CompressedFile *file) {
+	if (!mOpenParams.indexMemory)
+		return;
+	forget(file);
+	mResident.push_front(Resident(file));
+	mResidentPos[file] = mResident.begin();
+	mResident.front().bytes = file->indexMemory();
+	mResidentBytes += mResident.front().bytes;
+	evict();
+}
+
+void FileList::forget(CompressedFile *file) {
+	unordered_map<const CompressedFile*, ResidentList::iterator>::iterator
+		found = mResidentPos.find(file);
+	if (found == mResidentPos.end())
+		return;
+	mResidentBytes -= found->second->bytes;
+	mResident.erase(found->second);
+	mResidentPos.erase(found);
+}
+
+void FileList::evict() {
+	ResidentList::iterator iter = mResident.end();
+	while (mResidentBytes > mOpenParams.indexMemory
+			&& iter != mResident.begin()) {
+		--iter;
+		CompressedFile *file = iter->file;
+		if (file->held() || !file->unload())
+			continue;
+		mResidentBytes -= iter->bytes;
+		mResidentPos.erase(file);
+		iter = mResident.erase(iter);
+	}
+}
+
+void FileList::load(CompressedFile *file) {
+	bool loaded = file->load();
+	touch(file);
+	if (!loaded || !file->indexPending())
+		return;
+	
+	Lock lock(mMutex);
+	if (mIndexPool)
+		mIndexPool->enqueue(new IndexJob(*this, file));
+	else
+		mUnbuilt.push_back(file);
+}
+
+void FileList::buildIndexes(ThreadPool& pool, ThreadPool& workPool) {
+	Lock lock(mMutex);
+	mIndexPool = &pool;
+	mWorkPool = &workPool;
+	std::vector<CompressedFile*>::iterator iter;
+	for (iter = mUnbuilt.begin(); iter != mUnbuilt.end(); ++iter)
+		pool.enqueue(new IndexJob(*this, *iter));
+	mUnbuilt.clear();
+}
+
+void FileList::build(CompressedFile *file) {
+	struct stat st;
+	uint64_t bytes = 0;
+	if (mIOBudget && stat(file->path().c_str(), &st) == 0)
+		bytes = st.st_size;
+	{
+		Lock lock(mMutex);
+		file->workPool(mWorkPool);
+	}
+	MemoryBudget::Reservation reserve(mIOBudget.get(), bytes);
+	file->buildPending();
+	touch(file);
+}
+
+void FileList::LoadJob::operator()() {
+	bool ok = true;
+	try {
+		if (file->load() && file->indexPending())
+			info.list.build(file);
+		else
+			info.list.touch(file);
+	} catch (std::runtime_error& e) {
+		fprintf(stderr, "Error reading file %s, skipping: %s\n",
+			file->path().c_str(), e.what());
+		ok = false;
+	}
+	info.done(file, ok);
+}
+
+// Report progress every few seconds, on whichever thread is done
+void FileList::LoadInfo::done(CompressedFile *file, bool ok) {
+	Lock lock(cv);
+	--remain;
+	if (!ok)
+		failed.insert(file);
+	time_t now = time(NULL);
+	if (remain && now - lastReport >= 5) {
+		fprintf(stderr, "Indexed %lu of %lu files\n",
+			(unsigned long)(total - remain), (unsigned long)total);
+		lastReport = now;
+	}
+	cv.broadcast();
+}
+
+void FileList::loadAll() {
+	LoadInfo info(*this, mMap.size());
+	{
+		ThreadPool workPool(mOpenParams.indexThreads); // Outlives the jobs
+		ThreadPool pool(mOpenParams.indexThreads);
+		{
+			Lock lock(mMutex);
+			mWorkPool = &workPool;
+		}
+		for (Map::iterator iter = mMap.begin(); iter != mMap.end(); ++iter)
+			pool.enqueue(new LoadJob(info, iter->second));
+		
+		Lock lock(info.cv);
+		while (info.remain)
+			info.cv.wait();
+	}
+	{
+		Lock lock(mMutex);
+		mWorkPool = 0;
+	}
+	
+	// Files that loaded may have been unloaded again, to save memory
+	for (Map::iterator iter = mMap.begin(); iter != mMap.end(); ) {
+		if (!info.failed.count(iter->second)) {
+			++iter;
+		} else {
+			forget(iter->second);
+			delete iter->second;
+			mMap.erase(iter++);
+		}
+	}
+	fprintf(stderr, "Indexed %lu files in %ld seconds\n",
+		(unsigned long)mMap.size(), long(time(NULL) - info.start));
+}
+
 FileList::~FileList() {
 	for (Map::iterator iter = mMap.begin(); iter != mMap.end(); ++iter) {
 		delete iter->second;
 	}
+	for (DirMap::iterator d = mDirs.begin(); d != mDirs.end(); ++d) {
+		NodeMap& nodes = d->second.nodes;
+		for (NodeMap::iterator n = nodes.begin(); n != nodes.end(); ++n)
+			delete n->second.file;
+	}
+	for (size_t i = 0; i < mRetired.size(); ++i)
+		delete mRetired[i];
 }
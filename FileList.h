@@ -4,19 +4,39 @@
 #include "CompressedFile.h"
 #include "TR1.h"
 #include "PathUtils.h"
+#include "FilePool.h"
+#include "MemoryBudget.h"
+#include "ThreadPool.h"
+#include "Verifier.h"
 
+#include <list>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 #include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
 
 struct OpenParams {
 	uint64_t maxBlock;
 	std::string indexRoot;
 	size_t blockFactor;
+	Verifier::Mode verify;
+	std::vector<std::string> zstdDicts; // Dictionary files for zstd frames
+	uint64_t decoderMemory; // Zero for a default based on physical memory
+	size_t indexThreads;	// Zero for one per CPU
+	uint64_t indexIO;		// Compressed bytes to index at once, zero for any
+	uint64_t indexMemory;	// For loaded indexes, zero for no limit
+	size_t openFiles;		// Descriptors for reading, zero for a default
+	bool probeFormats;		// Try every format if no magic matches
 
-	OpenParams(uint64_t pMaxBlock, std::string pIndexRoot, size_t pBlockFactor)
-		: maxBlock(pMaxBlock), indexRoot(pIndexRoot), blockFactor(pBlockFactor) {}
+	OpenParams(uint64_t pMaxBlock, std::string pIndexRoot, size_t pBlockFactor,
+			Verifier::Mode pVerify = Verifier::Off)
+		: maxBlock(pMaxBlock), indexRoot(pIndexRoot), blockFactor(pBlockFactor),
+		verify(pVerify), decoderMemory(0), indexThreads(0), indexIO(0),
+		indexMemory(0), openFiles(0), probeFormats(false) {}
 };
 
 class FileList {
@@ -29,31 +49,234 @@ protected:
 	typedef unordered_map<std::string,CompressedFile*> Map;
 	Map mMap;
 	OpenParams mOpenParams;
+	Verifier mVerifier;
+	MemoryBudget mBudget;
+	FilePool mFilePool;
 	
+	Mutex mMutex; // Protects the pools, and files waiting for them
+	ThreadPool *mIndexPool;
+	ThreadPool *mWorkPool; // Shared by every build, for work within it
+	std::vector<CompressedFile*> mUnbuilt;
+	
+	// Limits how much is indexed at once, counting compressed bytes
+	unique_ptr<MemoryBudget> mIOBudget;
+	
+	// Each format checks a buffer from the start of a file for its magic,
+	// so only a format that's likely to work is opened
+	typedef bool (*SniffFunc)(const Buffer& head);
+	typedef std::string (*NameFunc)(const std::string& path);
 	typedef CompressedFile* (*OpenFunc)(const std::string& path,
 		const OpenParams& params);
-	typedef std::vector<OpenFunc> OpenerList;
-	static const OpenerList Openers;
-	static OpenerList initOpeners();
+	struct Format {
+		SniffFunc sniff;
+		NameFunc name;
+		OpenFunc open;
+	};
+	typedef std::vector<Format> FormatList;
+	static const FormatList Formats;
+	static FormatList initFormats();
+	static const size_t SniffSize;
+	
+	void loadDicts(); // Throws if any is unusable
+	static void readHead(const std::string& source, Buffer& head);
+	CompressedFile *open(const std::string& source, bool sniffed,
+		const Buffer& head);
+	CompressedFile *openSource(const std::string& source);
+	void adopt(CompressedFile *file);
+	
+	/* In mirror mode, files come from a source directory tree instead.
+	 * Each directory is only scanned once something looks inside it, and
+	 * scanned again if its mtime changes. Files are only opened once
+	 * they're looked up. Scanning and opening happen without the list
+	 * locked, so a slow directory doesn't hold up the rest. */
+	struct Node {
+		std::string source;
+		ino_t inode;
+		bool dir;
+		const Format *format;	// For files, null if it can't be opened
+		CompressedFile *file;
+		Node() : inode(0), dir(false), format(0), file(0) { }
+	};
+	typedef std::map<std::string, Node> NodeMap; // By name
+	struct Dir {
+		std::string source;
+		time_t mtime;
+		bool scanned;
+		unsigned scans; // Changes each time nodes are replaced
+		NodeMap nodes;
+		Dir() : mtime(0), scanned(false), scans(0) { }
+	};
+	typedef unordered_map<std::string, Dir> DirMap; // By dest path
+	
+	std::string mMirror; // Source directory, empty if not mirroring
+	
+	// Protects mMap once mounted, and everything below
+	mutable Mutex mListMutex;
+	DirMap mDirs;
+	std::vector<CompressedFile*> mRetired; // Gone, but maybe still held
+	std::multiset<std::string> mAdding; // Sources still being loaded
+	
+	void reap(); // Delete retired files that nothing holds
+	
+	/* With a limit on index memory, loaded files are kept in order of
+	 * use. Once they use too much, the indexes of files that nothing holds
+	 * are unloaded, starting with the least recently used. */
+	struct Resident {
+		CompressedFile *file;
+		uint64_t bytes;
+		Resident(CompressedFile *f) : file(f), bytes(0) { }
+	};
+	typedef std::list<Resident> ResidentList; // Most recent first
+	ResidentList mResident;
+	unordered_map<const CompressedFile*, ResidentList::iterator> mResidentPos;
+	uint64_t mResidentBytes;
+	
+	void touch(CompressedFile *file);
+	void touchLocked(CompressedFile *file);
+	void forget(CompressedFile *file);
+	void evict();
+	
+	// These are called with the list locked, and unlock it while they read
+	Dir *dir(const std::string& dest);	// Up to date, or null if not a dir
+	CompressedFile *openNode(Dir& d, const std::string& name,
+		const std::string& destDir);
+	
+	static void scan(const std::string& source, NodeMap& nodes);
+	void replaceNodes(Dir& d, NodeMap& nodes);
+	
+	struct IndexJob : public ThreadPool::Job {
+		FileList& list;
+		CompressedFile *file;
+		IndexJob(FileList& l, CompressedFile *f) : list(l), file(f)
+			{ file->hold(); }
+		virtual void operator()() { list.build(file); list.release(file); }
+	};
+	
+	struct AddJob : public ThreadPool::Job {
+		FileList& list;
+		std::string source;
+		AddJob(FileList& l, const std::string& s) : list(l), source(s) { }
+		virtual void operator()() { list.publish(source); }
+	};
+	void publish(const std::string& source);
+	
+	// Shared by all the jobs of loadAll()
+	struct LoadInfo {
+		FileList& list;
+		ConditionVariable cv;
+		size_t total, remain;
+		time_t start, lastReport;
+		std::set<CompressedFile*> failed;
+		LoadInfo(FileList& l, size_t t) : list(l), total(t), remain(t),
+			start(time(NULL)), lastReport(start) { }
+		void done(CompressedFile *file, bool ok);
+	};
+	
+	struct LoadJob : public ThreadPool::Job {
+		LoadInfo& info;
+		CompressedFile *file;
+		LoadJob(LoadInfo& i, CompressedFile *f) : info(i), file(f) { }
+		virtual void operator()();
+	};
+	
+	void build(CompressedFile *file);
 	
 public:
 	FileList(OpenParams params)
-		: mOpenParams(params)
- {
+		: mOpenParams(params), mVerifier(params.verify),
+		mBudget(params.decoderMemory), mFilePool(params.openFiles),
+		mIndexPool(0), mWorkPool(0), mResidentBytes(0) {
 		if (!mOpenParams.indexRoot.empty())
 			mOpenParams.indexRoot = PathUtils::realpath(mOpenParams.indexRoot);
+		if (params.indexIO)
+			mIOBudget.reset(new MemoryBudget(params.indexIO));
+		loadDicts();
 	}
 	virtual ~FileList();
 	
-	CompressedFile *find(const std::string& dest);
+	// Something that was looked up. A file is held as long as the entry is.
+	class Entry {
+		Entry(const Entry&);
+		Entry& operator=(const Entry&);
+	
+		FileList *mList;
+		friend class FileList;
+	
+	public:
+		CompressedFile *file; // Null for directories
+		bool dir;
+		ino_t inode; // Of the source, or zero if unknown
+		
+		Entry() : mList(0), file(0), dir(false), inode(0) { }
+		~Entry() { reset(); }
+		void reset() {
+			if (file)
+				mList->release(file);
+			file = 0;
+			dir = false;
+			inode = 0;
+		}
+	};
+	
+	bool lookup(const std::string& dest, Entry& entry);
+	
+	// Stop holding a file. If it was removed and nothing else holds it,
+	// it's deleted.
+	void release(const CompressedFile *file);
+	void collect(); // Delete any removed files that nothing holds
+	
 	void add(const std::string& source);
 	
+	/* Change the files while mounted. A file that's added is loaded and
+	 * indexed in the background, and only appears once it's ready. If
+	 * there's already a file with its name, it's replaced. A file can be
+	 * removed by its name or its source. Neither works when mirroring. */
+	void addLater(const std::string& source);
+	bool remove(const std::string& name);
+	std::vector<std::string> adding() const; // Sources not ready yet
+	void mirror(const std::string& source);
+	bool mirroring() const { return !mMirror.empty(); }
+	
+	const Verifier& verifier() const { return mVerifier; }
+	const OpenParams& params() const { return mOpenParams; }
+	
+	// Load a file before it's first used, throwing if that fails. If its
+	// index must be built, that happens in the background.
+	void load(CompressedFile *file);
+	
+	// Build indexes in this pool, from now on. Work within each build, like
+	// validating blocks, goes to workPool, so nested work stays bounded.
+	void buildIndexes(ThreadPool& pool, ThreadPool& workPool);
+	
+	// Load every file now, building indexes as needed, several at once.
+	// Files that fail are dropped. Only for files that were added, not
+	// mirrored.
+	void loadAll();
+	
+	// Call op with the path of each entry in a directory. Returns false if
+	// it's not a directory.
 	template <typename Op>
-	void forNames(Op op) {
-		Map::const_iterator iter;
-		for (iter = mMap.begin(); iter != mMap.end(); ++iter)
-			op(iter->first);
+	bool forNames(const std::string& dest, Op op) {
+		Lock lock(mListMutex);
+		if (!mirroring()) {
+			if (dest != "/")
+				return false;
+			Map::const_iterator iter;
+			for (iter = mMap.begin(); iter != mMap.end(); ++iter)
+				op(iter->first);
+			return true;
+		}
+		
+		Dir *d = dir(dest);
+		if (!d)
+			return false;
+		for (NodeMap::const_iterator iter = d->nodes.begin();
+				iter != d->nodes.end(); ++iter)
+			op("/" + iter->first);
+		return true;
 	}
+	template <typename Op>
+	void forNames(Op op) { forNames("/", op); }
 };
 
 #endif // FILELIST_H
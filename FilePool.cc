@@ -0,0 +1,76 @@
+#include "FilePool.h"
+
+#include <algorithm>
+
+#include <sys/resource.h>
+
+namespace {
+	// Fallback if we can't tell what the process may open
+	const size_t FallbackLimit = 512;
+	const size_t MinLimit = 16;
+}
+
+FilePool::FilePool(size_t limit)
+	: mLimit(limit ? limit : defaultLimit()) { }
+
+// Half of what we may open, leaving room for indexing and everything else
+size_t FilePool::defaultLimit() {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+		return FallbackLimit;
+	return std::max(size_t(rl.rlim_cur / 2), MinLimit);
+}
+
+bool FilePool::closeIdle() {
+	if (mIdle.empty())
+		return false;
+	mMap.erase(mIdle.back());
+	mIdle.pop_back();
+	return true;
+}
+
+FilePool::Entry& FilePool::acquire(uint64_t id, const std::string& path) {
+	Lock lock(mCond);
+	Map::iterator found;
+	while ((found = mMap.find(id)) == mMap.end()) {
+		if (mMap.size() < mLimit || closeIdle()) {
+			// Open while locked, it's quick and keeps the count right
+			Entry& entry = mMap[id];
+			entry.id = id;
+			try {
+				entry.fh.open(path, O_RDONLY);
+			} catch (FileHandle::Exception& e) {
+				mMap.erase(id);
+				mCond.broadcast(); // Someone else may fit now
+				throw;
+			}
+			++entry.users;
+			return entry;
+		}
+		mCond.wait(); // Everything's in use
+	}
+
+	Entry& entry = found->second;
+	if (entry.users++ == 0)
+		mIdle.erase(entry.idle);
+	return entry;
+}
+
+void FilePool::release(Entry& entry) {
+	Lock lock(mCond);
+	if (--entry.users)
+		return;
+	mIdle.push_front(entry.id);
+	entry.idle = mIdle.begin();
+	mCond.broadcast();
+}
+
+void FilePool::close(uint64_t id) {
+	Lock lock(mCond);
+	Map::iterator found = mMap.find(id);
+	if (found == mMap.end() || found->second.users)
+		return;
+	mIdle.erase(found->second.idle);
+	mMap.erase(found);
+	mCond.broadcast();
+}
@@ -0,0 +1,82 @@
+#ifndef FILEPOOL_H
+#define FILEPOOL_H
+
+#include "lzopfs.h"
+#include "FileHandle.h"
+#include "ThreadPool.h"
+#include "TR1.h"
+
+#include <list>
+#include <string>
+
+// Shares one read-only descriptor per compressed file among everyone
+// reading it, and limits how many are open at once. Descriptors nobody is
+// using stay open for next time, until the least recently used must be
+// closed to make room.
+class FilePool {
+protected:
+	typedef std::list<uint64_t> IdleList; // Most recent first
+
+	struct Entry {
+		uint64_t id;
+		FileHandle fh;
+		size_t users;
+		IdleList::iterator idle; // Only if there are no users
+		Entry() : id(0), users(0) { }
+	};
+	typedef unordered_map<uint64_t, Entry> Map; // By file ID
+
+	size_t mLimit;
+	Map mMap;
+	IdleList mIdle;
+	ConditionVariable mCond;
+
+	FilePool(const FilePool&);
+	FilePool& operator=(const FilePool&);
+
+	bool closeIdle(); // False if nothing is idle
+
+	// If every descriptor is in use, waits for one to be free
+	Entry& acquire(uint64_t id, const std::string& path);
+	void release(Entry& entry);
+
+public:
+	// A limit of zero picks one based on the process's limit
+	FilePool(size_t limit = 0);
+
+	static size_t defaultLimit();
+
+	size_t limit() const { return mLimit; }
+
+	// Close a file's descriptor, once nobody will use it again
+	void close(uint64_t id);
+
+	// Holds a descriptor for as long as it's in scope. Without a pool, it
+	// opens its own.
+	class Handle {
+		FilePool *mPool;
+		Entry *mEntry;
+		FileHandle mOwn;
+
+		Handle(const Handle&);
+		Handle& operator=(const Handle&);
+
+	public:
+		Handle(FilePool *pool, uint64_t id, const std::string& path)
+				: mPool(pool), mEntry(0) {
+			if (mPool)
+				mEntry = &mPool->acquire(id, path);
+			else
+				mOwn.open(path, O_RDONLY);
+		}
+		~Handle() {
+			if (mEntry)
+				mPool->release(*mEntry);
+		}
+
+		const FileHandle& operator*() const
+			{ return mEntry ? mEntry->fh : mOwn; }
+	};
+};
+
+#endif // FILEPOOL_H
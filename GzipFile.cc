@@ -6,6 +6,10 @@
 
 const size_t GzipFile::WindowSize = 1 << MAX_WBITS; 
 
+bool GzipFile::sniff(const Buffer& head) {
+	return head.size() >= 2 && head[0] == 0x1f && head[1] == 0x8b;
+}
+
 void GzipFile::checkFileType(FileHandle& fh) {
 	try {
 		GzipHeaderReader rd(fh);
@@ -20,9 +24,9 @@ void GzipFile::checkFileType(FileHandle& fh) {
 
 // Fixup the prev block
 void GzipFile::setLastBlockSize(off_t uoff, off_t coff) {
-	if (mBlocks.empty())
+	if (mUnready.empty())
 		return;
-	Block* p = mBlocks.back();
+	Block* p = mUnready.back();
 	p->usize = uoff - p->uoff;
 	p->csize = coff - p->coff;
 }
@@ -30,7 +34,7 @@ void GzipFile::setLastBlockSize(off_t uoff, off_t coff) {
 Buffer& GzipFile::addBlock(off_t uoff, off_t coff, size_t bits) {
 	setLastBlockSize(uoff, coff);
 	GzipBlock *b = new GzipBlock(uoff, coff, bits);
-	IndexedCompFile::addBlock(b);
+	IndexedCompFile::addBlock(b, false);
 	return b->dict;
 }
 
@@ -38,6 +42,15 @@ void GzipFile::buildIndex(FileHandle& fh) {
 	fh.seek(0, SEEK_SET);
 	SavingGzipReader rd(fh);
 	off_t minBlock = mBlockFactor * WindowSize;
+	off_t lastIdx = 0;		// Uncompressed pos of last indexed block
+	
+	if (mResume) {
+		// Start over at the last block we had, it's a safe place to start
+		GzipBlock *gb = dynamic_cast<GzipBlock*>(mResume);
+		rd.resume(gb->uoff, gb->coff, gb->bits, gb->dict);
+		addBlock(gb->uoff, gb->coff, gb->bits).swap(gb->dict);
+		lastIdx = gb->uoff;
+	}
 	
 	/* Go through every block in the file.
 	 * For each block, try to see first if it can be decoded independently,
@@ -48,7 +61,6 @@ void GzipFile::buildIndex(FileHandle& fh) {
 	bool backtrack = false; // Have we passed a block we may want?
 	// Info of block we're currently examining
 	off_t uoff = 0, coff = 0, bits = 0;
-	off_t lastIdx = 0;		// Uncompressed pos of last indexed block
 	
 	int err;
 	while (true) {
@@ -117,6 +129,24 @@ void GzipFile::buildIndex(FileHandle& fh) {
 //	dumpBlocks();
 }
 
+void GzipFile::loadIndex(FileHandle& fh) {
+	IndexedCompFile::loadIndex(fh);
+	if (mPending)
+		mIndexFH.open(partialIndexPath(), O_RDONLY);
+}
+
+bool GzipFile::unloadFile() {
+	if (!IndexedCompFile::unloadFile())
+		return false;
+	mIndexFH.close(); // Dictionaries will be in the image next time
+	return true;
+}
+
+void GzipFile::resetFile() {
+	IndexedCompFile::resetFile();
+	mIndexFH.close();
+}
+
 GzipFile::GzipFile(const std::string& path, const OpenParams& params)
 		: IndexedCompFile(path, params.indexRoot), mBlockFactor(params.blockFactor) {
 	initialize(params.maxBlock);
@@ -125,14 +155,20 @@ GzipFile::GzipFile(const std::string& path, const OpenParams& params)
 void GzipFile::decompressBlock(const FileHandle& fh, const Block& b,
 		Buffer& ubuf) const {
 	const GzipBlock& gb = dynamic_cast<const GzipBlock&>(b);
+	Buffer dict;
+	loadDict(mIndexFH, gb, dict);
 	ubuf.resize(gb.usize);
-	GzipBlockReader rd(fh, ubuf, b, gb.dict, gb.bits);
+	GzipBlockReader rd(fh, ubuf, b, dict, gb.bits);
 	rd.read();
+	
+	// Gzip only has a checksum for the whole file
+	if (verifyWanted())
+		verifyUnavailable();
 }
 
-std::string GzipFile::destName() const {
+std::string GzipFile::destNameFor(const std::string& path) {
 	using namespace PathUtils;
-	std::string base = basename(path());
+	std::string base = basename(path);
 	if (replaceExtension(base, "tgz", "tar")) return base;
 	if (removeExtension(base, "gz")) return base;
 	return base;
@@ -141,10 +177,80 @@ std::string GzipFile::destName() const {
 namespace {
 	enum {
 		BlockBitsMask = 0x07,
+		BlockZDictFlag = 0x40,	// Dictionary is deflated, with a size prefix
 		BlockDictFlag = 0x80,
+		BlockKnownFlags = BlockBitsMask | BlockZDictFlag | BlockDictFlag,
+	};
+	
+	// How a block is packed into the block table
+	enum {
+		PackedDictFlag = 1 << 3,
+		PackSizeShift = 4,
+		PackSizeBits = 16,
+		PackOffShift = PackSizeShift + PackSizeBits,
 	};
 };
 
+// Windows are mostly text or already-compressed data, so zlib gets them
+// down to a fraction of WindowSize in the common case
+void GzipFile::packDict(const Buffer& dict, Buffer& packed) {
+	uLongf size = compressBound(dict.size());
+	packed.resize(size);
+	int err = compress2(&packed[0], &size, &dict[0], dict.size(),
+		Z_BEST_COMPRESSION);
+	if (err != Z_OK)
+		throw std::runtime_error("can't compress gzip dictionary");
+	packed.resize(size);
+}
+
+void GzipFile::unpackDict(const Buffer& packed, Buffer& dict) {
+	dict.resize(WindowSize);
+	uLongf size = dict.size();
+	int err = uncompress(&dict[0], &size, &packed[0], packed.size());
+	if (err != Z_OK || size != WindowSize)
+		throw std::runtime_error("corrupt gzip dictionary in index");
+}
+
+// From the log if it's open, otherwise from the finished index
+void GzipFile::loadDict(const FileHandle& idx, const GzipBlock& b,
+		Buffer& dict) const {
+	if (b.dictSize == 0)
+		return;
+	Buffer packed;
+	Buffer& raw = b.dictPacked ? packed : dict;
+	if (idx.open()) {
+		idx.pread(b.dictOff, raw, b.dictSize);
+	} else {
+		const uint8_t *data = indexData(b.dictOff, b.dictSize);
+		raw.assign(data, data + b.dictSize);
+	}
+	if (b.dictPacked)
+		unpackDict(packed, dict);
+}
+
+void GzipFile::prepareResume(const FileHandle& idx, Block *b) {
+	GzipBlock *gb = dynamic_cast<GzipBlock*>(b);
+	loadDict(idx, *gb, gb->dict);
+}
+
+uint64_t GzipFile::packBlock(const Block& b) const {
+	const GzipBlock& gb = dynamic_cast<const GzipBlock&>(b);
+	if (gb.dictSize >> PackSizeBits || uint64_t(gb.dictOff) >> (64 - PackOffShift))
+		throw std::runtime_error("gzip index too large");
+	return uint64_t(gb.dictOff) << PackOffShift
+		| uint64_t(gb.dictSize) << PackSizeShift
+		| (gb.dictPacked ? PackedDictFlag : 0)
+		| (gb.bits & BlockBitsMask);
+}
+
+void GzipFile::unpackBlock(uint64_t aux, Block& b) const {
+	GzipBlock& gb = dynamic_cast<GzipBlock&>(b);
+	gb.bits = aux & BlockBitsMask;
+	gb.dictPacked = aux & PackedDictFlag;
+	gb.dictSize = (aux >> PackSizeShift) & ((1 << PackSizeBits) - 1);
+	gb.dictOff = aux >> PackOffShift;
+}
+
 bool GzipFile::readBlock(FileHandle& fh, Block *b) {
 	if (!IndexedCompFile::readBlock(fh, b))
 		return false;
@@ -152,24 +258,63 @@ bool GzipFile::readBlock(FileHandle& fh, Block *b) {
 	GzipBlock *gb = dynamic_cast<GzipBlock*>(b);
 	uint8_t flags;
 	fh.readBE(flags);
+	if (flags & ~BlockKnownFlags) // Can't even tell where the record ends
+		throwFormat("unknown block flags in index " + fh.path());
 	gb->bits = flags & BlockBitsMask;
-	if (flags & BlockDictFlag)
-		fh.read(gb->dict, WindowSize);
+	
+	// Just remember where the dictionary is, don't load it yet
+	if (flags & BlockZDictFlag) {
+		fh.readBE(gb->dictSize);
+		gb->dictPacked = true;
+	} else if (flags & BlockDictFlag) {
+		gb->dictSize = WindowSize;
+	}
+	if (gb->dictSize) {
+		gb->dictOff = fh.tell();
+		fh.seek(gb->dictSize);
+	}
 	
 	return true;
 }
 
-void GzipFile::writeBlock(FileHandle& fh, const Block* b) const {
+void GzipFile::writeBlock(FileHandle& fh, Block* b) {
 	IndexedCompFile::writeBlock(fh, b);
 	
-	const GzipBlock* gb = dynamic_cast<const GzipBlock*>(b);
+	GzipBlock* gb = dynamic_cast<GzipBlock*>(b);
 	uint8_t flags = (gb->bits & BlockBitsMask);
-	if (!gb->dict.empty())
-		flags |= BlockDictFlag;
+	Buffer packed;
+	if (!gb->dict.empty()) {
+		packDict(gb->dict, packed);
+		flags |= (packed.size() < gb->dict.size()) ? BlockZDictFlag
+			: BlockDictFlag;
+	}
 	
 	fh.writeBE(flags);
-	if (flags & BlockDictFlag)
-		fh.write(gb->dict);
+	if (flags & BlockZDictFlag) {
+		gb->dictSize = packed.size();
+		gb->dictPacked = true;
+		fh.writeBE(gb->dictSize);
+	} else if (flags & BlockDictFlag) {
+		gb->dictSize = gb->dict.size();
+	}
+	if (gb->dictSize) {
+		gb->dictOff = fh.tell();
+		fh.write(gb->dictPacked ? packed : gb->dict);
+	}
+	
+	// It's in the index now, no need to keep it around
+	Buffer().swap(gb->dict);
+}
+
+void GzipFile::copyIndexData(const FileHandle& log, FileHandle& out,
+		Block& b) const {
+	GzipBlock& gb = dynamic_cast<GzipBlock&>(b);
+	if (gb.dictSize == 0)
+		return;
+	Buffer dict;
+	log.pread(gb.dictOff, dict, gb.dictSize);
+	gb.dictOff = out.tell();
+	out.write(dict);
 }
 
 #endif // HAVE_ZLIB
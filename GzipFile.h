@@ -11,26 +11,52 @@ class GzipFile : public IndexedCompFile {
 protected:
 	struct GzipBlock : public Block {
 		size_t bits;
-		Buffer dict;
+		Buffer dict;		// Only held until the index is written
+		
+		// Where the dictionary lives in the index
+		off_t dictOff;
+		uint32_t dictSize;	// Zero if there's no dictionary
+		bool dictPacked;
 		
 		GzipBlock(off_t uoff, off_t coff, size_t b)
-			: Block(0, 0, uoff, coff), bits(b) { }
+			: Block(0, 0, uoff, coff), bits(b), dictOff(0), dictSize(0),
+			dictPacked(false) { }
 	};
 	
+	// While building, dictionaries are read from the log on demand
+	FileHandle mIndexFH;
+	
 	
 	void setLastBlockSize(off_t uoff, off_t coff);
 	Buffer& addBlock(off_t uoff, off_t coff, size_t bits);
 	
+	static void packDict(const Buffer& dict, Buffer& packed);
+	static void unpackDict(const Buffer& packed, Buffer& dict);
+	void loadDict(const FileHandle& idx, const GzipBlock& b,
+		Buffer& dict) const;
+	
 	virtual void checkFileType(FileHandle &fh);
+	virtual void loadIndex(FileHandle& fh);
+	virtual bool unloadFile();
+	virtual void resetFile();
 	virtual void buildIndex(FileHandle& fh);
 	
 	virtual Block* newBlock() const { return new GzipBlock(0, 0, 0); }
+	virtual uint64_t packBlock(const Block& b) const;
+	virtual void unpackBlock(uint64_t aux, Block& b) const;
 	virtual bool readBlock(FileHandle& fh, Block* b);	// True unless EOF
-	virtual void writeBlock(FileHandle& fh, const Block *b) const;
+	virtual void writeBlock(FileHandle& fh, Block *b);
+	virtual void copyIndexData(const FileHandle& log, FileHandle& out,
+		Block& b) const;
+	
+	virtual bool canResume() const { return true; }
+	virtual void prepareResume(const FileHandle& idx, Block *b);
 
 public:
 	static const size_t WindowSize;
 
+	static bool sniff(const Buffer& head);
+	static std::string destNameFor(const std::string& path);
 	static CompressedFile* open(const std::string& path, const OpenParams& params)
 		{ return new GzipFile(path, params); }
 	
@@ -38,7 +64,7 @@ public:
 
 	GzipFile(const std::string& path, const OpenParams& params);
 	
-	virtual std::string destName() const;
+	virtual std::string destName() const { return destNameFor(path()); }
 	
 	virtual void decompressBlock(const FileHandle& fh, const Block& b,
 		Buffer& ubuf) const;
@@ -179,6 +179,27 @@ void SavingGzipReader::restore() {
 	mFH.seek(mSaveSeek, SEEK_SET);
 }
 
+void SavingGzipReader::resume(off_t opos, off_t ipos, size_t bits,
+		const Buffer& dict) {
+	mWrap = Raw;
+	mInitOutPos = opos;
+	mFH.seek(ipos - (bits ? 1 : 0), SEEK_SET);
+	setDict(dict);
+	if (bits) {
+		uint8_t byte;
+		mFH.read(&byte, sizeof(byte));
+		prime(byte, bits);
+	}
+	
+	// Our window should look like it would have if we'd got here normally
+	if (!dict.empty()) {
+		std::copy(dict.end() - std::min(dict.size(), mOutBuf.size()),
+			dict.end(), mOutBuf.begin());
+		mStream->next_out = &mOutBuf[0] + mOutBuf.size();
+		mStream->avail_out = 0;
+	}
+}
+
 void SavingGzipReader::copyWindow(Buffer& buf) {
 	buf.resize(outBuf().size());
 	std::rotate_copy(outBuf().begin(), outBuf().end() - mStream->avail_out,
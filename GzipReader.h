@@ -159,6 +159,9 @@ public:
 	void save();
 	void restore();
 	
+	// Start at a block boundary in the middle of the stream
+	void resume(off_t opos, off_t ipos, size_t bits, const Buffer& dict);
+	
 	void copyWindow(Buffer& buf);
 };
 
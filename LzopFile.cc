@@ -2,7 +2,10 @@
 
 #include "LzopFile.h"
 
+#include "Checksum.h"
+#include "PairScanner.h"
 #include "PathUtils.h"
+#include "TR1.h"
 
 #include <algorithm>
 #include <cstdio>
@@ -19,79 +22,214 @@ const unsigned char LzopFile::Magic[] = { 0x89, 'L', 'Z', 'O', '\0', '\r', '\n',
 // Version of lzop we emulate
 const uint16_t LzopFile::LzopDecodeVersion = 0x1010;
 
-void LzopFile::readHeaders(FileHandle& fh, uint32_t& flags) {
+bool LzopFile::sniff(const Buffer& head) {
+	return head.size() >= sizeof(Magic)
+		&& memcmp(&head[0], Magic, sizeof(Magic)) == 0;
+}
+
+namespace {
+	template <typename T>
+	T getBE(const Buffer& buf, size_t& i) {
+		if (i + sizeof(T) > buf.size())
+			throw FileHandle::EOFException("lzop header");
+		T t;
+		std::copy(&buf[i], &buf[i] + sizeof(T), reinterpret_cast<uint8_t*>(&t));
+		FileHandle::convertBE(t);
+		i += sizeof(T);
+		return t;
+	}
+}
+
+// Returns the position of the first block
+off_t LzopFile::readHeaders(const FileHandle& fh, off_t pos, uint32_t& flags)
+		const {
+	Buffer buf(MaxHeaderSize);
+	buf.resize(fh.tryPRead(pos, &buf[0], buf.size()));
 	try {
 		// Check magic
-		Buffer magic;
-		fh.read(magic, sizeof(Magic));
-		if (memcmp(&magic[0], Magic, magic.size()) != 0)
+		size_t i = sizeof(Magic);
+		if (buf.size() < i || memcmp(&buf[0], Magic, i) != 0)
 			throwFormat("magic mismatch");
-		off_t headerStart = fh.tell();
+		const size_t headerStart = i;
 		
-		uint16_t lzopEncVers, lzopMinVers, lzoVers;
-		fh.readBE(lzopEncVers);
-		fh.readBE(lzoVers);
-		fh.readBE(lzopMinVers);
+		getBE<uint16_t>(buf, i); // lzop version
+		getBE<uint16_t>(buf, i); // lzo version
+		uint16_t lzopMinVers = getBE<uint16_t>(buf, i);
 		if (lzopMinVers > LzopDecodeVersion)
 			throwFormat("lzop version too new");
 		
-		uint8_t method, level;
-		fh.readBE(method);
-		fh.readBE(level);
+		getBE<uint8_t>(buf, i); // method
+		getBE<uint8_t>(buf, i); // level
 		
-		fh.readBE(flags);
+		flags = getBE<uint32_t>(buf, i);
 		if (flags & Filter)
 			throwFormat("filter not supported");
 		
-		fh.seek(3 * sizeof(uint32_t)); // skip mode, mtimes
+		i += 3 * sizeof(uint32_t); // skip mode, mtimes
 		
-		uint8_t filenameSize;
-		fh.readBE(filenameSize);
-		if (filenameSize > 0)
-			fh.seek(filenameSize);
+		uint8_t filenameSize = getBE<uint8_t>(buf, i);
+		i += filenameSize;
 		
 		
 		// Check the checksum
-		size_t headerSize = fh.tell() - headerStart;
-		fh.seek(headerStart, SEEK_SET);
-		Buffer header;
-		fh.read(header, headerSize);
-		
-		Checksum cksum;
-		fh.readBE(cksum);
-		if (cksum != checksum((flags & HeaderCRC) ? CRC : Adler, header))
+		const size_t headerEnd = i;
+		Checksum cksum = getBE<Checksum>(buf, i);
+		if (cksum != checksum((flags & HeaderCRC) ? CRC : Adler,
+				&buf[headerStart], headerEnd - headerStart))
 			throwFormat("checksum mismatch");
 		
 		
+		off_t end = pos + i;
 		if (flags & ExtraField) { // unused?
-			uint32_t extraSize;
-			fh.readBE(extraSize);
-			fh.seek(extraSize + sizeof(Checksum));
-		}		
+			uint32_t extraSize = getBE<uint32_t>(buf, i);
+			end += sizeof(uint32_t) + extraSize + sizeof(Checksum);
+		}
+		return end;
 	} catch (FileHandle::EOFException& e) {
 		throwFormat("EOF");
+		return 0;
 	}
 }
 
-LzopFile::Checksum LzopFile::checksum(ChecksumType type, const Buffer& buf) {
-	lzo_uint32 init = (type == CRC) ? 0 : 1;
-	return (type == CRC ? lzo_crc32 : lzo_adler32)(init, &buf[0], buf.size());
+LzopFile::Checksum LzopFile::checksum(ChecksumType type, const uint8_t *buf,
+		size_t size) {
+	if (type == CRC)
+		return ::Checksum::crc32(0, buf, size);
+	return ::Checksum::adler32(1, buf, size);
+}
+
+uint32_t LzopFile::Window::readBE32(off_t pos) {
+	const uint8_t *p;
+	if (mMap) {
+		if (pos + off_t(sizeof(uint32_t)) > off_t(mMap->size()))
+			throw FileHandle::EOFException(mFH.path());
+		p = mMap->data() + pos;
+	} else {
+		const off_t bufEnd = mBufPos + mBuf.size();
+		if (pos < mBufPos || pos + off_t(sizeof(uint32_t)) > bufEnd) {
+			mBuf.resize(WindowSize);
+			mBuf.resize(mFH.tryPRead(pos, &mBuf[0], mBuf.size()));
+			mBufPos = pos;
+			if (mBuf.size() < sizeof(uint32_t))
+				throw FileHandle::EOFException(mFH.path());
+		}
+		p = &mBuf[pos - mBufPos];
+	}
+	return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
 }
 
 void LzopFile::buildIndex(FileHandle& fh) {
-	off_t size = fh.size();
+	const off_t size = fh.size();
+	unique_ptr<MappedFile> map;
+	try {
+		map.reset(new MappedFile(fh));
+	} catch (FileHandle::Exception& e) {
+		// ok, we'll read it
+	}
+	Window w(fh, map.get());
 	
-	uint32_t flags = mFlags;
-	off_t uoff = 0;
-	while (true) {
-		uoff = findBlocks(fh, flags, uoff);
-		if (fh.tell() >= size)
-			break;
-		readHeaders(fh, flags);
+	// Index the first member as we go
+	uint32_t flags;
+	uint64_t uoff = 0;
+	off_t pos = readHeaders(fh, 0, flags);
+	pos = walkBlocks(w, pos, flags, uoff, 0);
+	if (pos >= size)
+		return;
+	
+	/* There are more members. Finding each one requires walking all the
+	 * blocks before it, so instead look for their magic, and index the
+	 * candidates in parallel, on the work pool that all builds share. A
+	 * candidate is real if the member before it ends where it starts. */
+	unique_ptr<ThreadPool> ownPool;
+	ThreadPool *pool = mWorkPool;
+	if (!pool) {
+		ownPool.reset(new ThreadPool(mIndexThreads));
+		pool = ownPool.get();
+	}
+	ConditionVariable cv;
+	size_t remain = 0;
+	MemberInfo info(*this, fh, map.get(), cv, remain);
+	MemberList members;
+	off_t scanned = pos;
+	
+	while (pos < size) {
+		scanned = std::max(scanned, pos);
+		members.clear();
+		if (map)
+			scanned = findMembers(*map, scanned, MemberBatch * pool->size(),
+				members);
+		{
+			Lock lock(cv);
+			for (size_t i = 0; i < members.size(); ++i) {
+				++remain;
+				pool->enqueue(new MemberJob(info, members[i]));
+			}
+			while (remain)
+				cv.wait();
+		}
+		
+		for (MemberList::iterator m = members.begin(); m != members.end();
+				++m) {
+			if (m->start < pos || !m->ok)
+				continue; // spurious
+			if (m->start > pos) // missed one?
+				break;
+			for (BlockVec::iterator b = m->blocks.begin();
+					b != m->blocks.end(); ++b) {
+				addBlock(new LzopBlock(b->usize, b->csize, uoff + b->uoff,
+					b->coff, b->sumType, b->sum));
+			}
+			uoff += m->usize;
+			pos = m->end;
+		}
+		
+		// If we didn't find the next member, do it the slow way
+		if (pos < size && (members.empty() || pos < scanned)) {
+			pos = readHeaders(fh, pos, flags);
+			pos = walkBlocks(w, pos, flags, uoff, 0);
+			scanned = std::max(scanned, pos);
+		}
+	}
+}
+
+void LzopFile::MemberJob::operator()() {
+	try {
+		uint32_t flags;
+		Window w(info.fh, info.map);
+		off_t pos = info.file.readHeaders(info.fh, member.start, flags);
+		member.end = info.file.walkBlocks(w, pos, flags, member.usize,
+			&member.blocks);
+		member.ok = true;
+	} catch (std::runtime_error& e) {
+		BlockVec().swap(member.blocks); // not a real member
+	}
+	
+	Lock lock(info.cv);
+	if (--info.remain == 0)
+		info.cv.signal();
+}
+
+// Find up to count possible member starts from pos, returning where we
+// stopped looking
+off_t LzopFile::findMembers(const MappedFile& map, off_t pos, size_t count,
+		MemberList& members) const {
+	PairScanner scanner;
+	scanner.add(Magic[0], Magic[1]);
+	
+	const uint8_t *end = map.end() - sizeof(Magic);
+	const uint8_t *p = map.data() + pos;
+	for (; p < end && members.size() < count; ++p) {
+		p = scanner.find(p, end);
+		if (p < end && memcmp(p, Magic, sizeof(Magic)) == 0)
+			members.push_back(Member(p - map.data()));
 	}
+	return std::min(p, end) - map.data();
 }
 
-off_t LzopFile::findBlocks(FileHandle& fh, uint32_t flags, off_t uoff) {	
+// Add blocks to the index, or to a list if given. Returns the position
+// after the end of the member.
+off_t LzopFile::walkBlocks(Window& w, off_t pos, uint32_t flags,
+		uint64_t& uoff, BlockVec *blocks) {	
 	// How much space for checksums?
 	size_t csums = 0, usums = 0;
 	if (flags & CRCComp) ++csums;
@@ -102,25 +240,39 @@ off_t LzopFile::findBlocks(FileHandle& fh, uint32_t flags, off_t uoff) {
 	usums *= sizeof(uint32_t);
 	
 	// Iterate thru the blocks
-	size_t bheader = 2 * sizeof(uint32_t);
-	uint32_t usize, csize;
-	off_t coff = fh.tell();
-	size_t sums;
+	const size_t bheader = 2 * sizeof(uint32_t);
 	while (true) {
-		fh.readBE(usize);
+		const uint32_t usize = w.readBE32(pos);
 		if (usize == 0)
-			return uoff;
-		fh.readBE(csize);
+			return pos + sizeof(uint32_t);
+		const uint32_t csize = w.readBE32(pos + sizeof(uint32_t));
+		if (csize > usize || usize > MaxBlockSize)
+			throw std::runtime_error("lzop block header invalid");
 		
-		sums = usums;
+		size_t sums = usums;
 		if (usize != csize)
 			sums += csums;
 		
-		addBlock(new Block(usize, csize, uoff, coff + bheader + sums));
+		// Adler comes first if both are present, but we prefer CRC
+		uint8_t sumType = NoChecksum;
+		Checksum sum = 0;
+		if (flags & CRCDec) {
+			sumType = CRC;
+			sum = w.readBE32(pos + bheader
+				+ ((flags & AdlerDec) ? sizeof(Checksum) : 0));
+		} else if (flags & AdlerDec) {
+			sumType = Adler;
+			sum = w.readBE32(pos + bheader);
+		}
 		
-		coff += sums + csize + 2 * sizeof(uint32_t);
+		const off_t coff = pos + bheader + sums;
+		if (blocks)
+			blocks->push_back(LzopBlock(usize, csize, uoff, coff, sumType, sum));
+		else
+			addBlock(new LzopBlock(usize, csize, uoff, coff, sumType, sum));
+		
+		pos = coff + csize;
 		uoff += usize;
-		fh.seek(sums + csize);
 	}
 }
 
@@ -129,7 +281,8 @@ namespace {
 }
 
 LzopFile::LzopFile(const std::string& path, const OpenParams& params)
-		: IndexedCompFile(path, params.indexRoot) {
+		: IndexedCompFile(path, params.indexRoot),
+		mIndexThreads(params.indexThreads) {
 	if (!gLzopInited) {
 		lzo_init();
 		gLzopInited = true;
@@ -137,8 +290,51 @@ LzopFile::LzopFile(const std::string& path, const OpenParams& params)
 	initialize(params.maxBlock);
 }
 
+bool LzopFile::readBlock(FileHandle& fh, Block *b) {
+	if (!IndexedCompFile::readBlock(fh, b))
+		return false;
+	
+	LzopBlock *lb = dynamic_cast<LzopBlock*>(b);
+	fh.readBE(lb->sumType);
+	fh.readBE(lb->sum);
+	return true;
+}
+
+void LzopFile::writeBlock(FileHandle& fh, Block *b) {
+	IndexedCompFile::writeBlock(fh, b);
+	
+	const LzopBlock *lb = dynamic_cast<const LzopBlock*>(b);
+	fh.writeBE(lb->sumType);
+	fh.writeBE(lb->sum);
+}
+
+uint64_t LzopFile::packBlock(const Block& b) const {
+	const LzopBlock& lb = dynamic_cast<const LzopBlock&>(b);
+	return uint64_t(lb.sumType) << 32 | lb.sum;
+}
+
+void LzopFile::unpackBlock(uint64_t aux, Block& b) const {
+	LzopBlock& lb = dynamic_cast<LzopBlock&>(b);
+	lb.sumType = aux >> 32;
+	lb.sum = uint32_t(aux);
+}
+
 void LzopFile::decompressBlock(const FileHandle& fh, const Block& b,
 		Buffer& ubuf) const {
+	decompressData(fh, b, ubuf);
+	
+	if (!verifyWanted())
+		return;
+	const LzopBlock& lb = dynamic_cast<const LzopBlock&>(b);
+	if (lb.sumType == NoChecksum)
+		verifyUnavailable();
+	else
+		verifyResult(b, checksum(ChecksumType(lb.sumType), &ubuf[0],
+			ubuf.size()) == lb.sum);
+}
+
+void LzopFile::decompressData(const FileHandle& fh, const Block& b,
+		Buffer& ubuf) const {
 	if (b.csize == b.usize) { // Uncompressed, just read it
 		fh.pread(b.coff, ubuf, b.usize);
 		return;
@@ -158,9 +354,9 @@ void LzopFile::decompressBlock(const FileHandle& fh, const Block& b,
 	}
 }
 
-std::string LzopFile::destName() const {
+std::string LzopFile::destNameFor(const std::string& path) {
 	using namespace PathUtils;
-	std::string base = basename(path());
+	std::string base = basename(path);
 	if (replaceExtension(base, "tzo", "tar")) return base;
 	if (removeExtension(base, "lzo")) return base;
 	return base;
@@ -4,6 +4,8 @@
 #include "lzopfs.h"
 #include "CompressedFile.h"
 #include "FileList.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
 
 class LzopFile : public IndexedCompFile {
 protected:
@@ -20,29 +22,102 @@ protected:
 		HeaderCRC	= 1 << 12,
 	};
 	
-	enum ChecksumType { Adler, CRC };
+	enum ChecksumType { NoChecksum, Adler, CRC };
+	
+	// Remember the checksum of the uncompressed data, for verification
+	struct LzopBlock : public Block {
+		uint8_t sumType;
+		Checksum sum;
+		LzopBlock(uint32_t us = 0, uint32_t cs = 0, uint64_t uo = 0,
+				uint64_t co = 0, uint8_t st = NoChecksum, Checksum s = 0)
+			: Block(us, cs, uo, co), sumType(st), sum(s) { }
+	};
 	
 	static const unsigned char Magic[];
 	static const uint16_t LzopDecodeVersion;
+	static const size_t MaxHeaderSize = 512; // not counting the extra field
+	static const uint32_t MaxBlockSize = 64 * 1024 * 1024;
+	static const size_t WindowSize = 1024 * 1024;
+	static const size_t MemberBatch = 4; // per thread
+	
+	// Reads block headers from a map of the file if we have one, otherwise
+	// from big chunks
+	class Window {
+		const FileHandle& mFH;
+		const MappedFile *mMap;
+		Buffer mBuf;
+		off_t mBufPos;
+		
+	public:
+		Window(const FileHandle& fh, const MappedFile *map)
+			: mFH(fh), mMap(map), mBufPos(0) { }
+		uint32_t readBE32(off_t pos);
+	};
+	
+	typedef std::vector<LzopBlock> BlockVec;
+	
+	// A member of a multi-member file, possibly spurious
+	struct Member {
+		off_t start, end;
+		uint64_t usize;
+		BlockVec blocks; // uoffs relative to the member
+		bool ok;
+		Member(off_t s = 0) : start(s), end(0), usize(0), ok(false) { }
+	};
+	typedef std::vector<Member> MemberList;
+	
+	struct MemberInfo {
+		LzopFile& file;
+		const FileHandle& fh;
+		const MappedFile *map;
+		ConditionVariable& cv;
+		size_t& remain;
+		MemberInfo(LzopFile& f, const FileHandle& h, const MappedFile *m,
+			ConditionVariable& pcv, size_t& r)
+			: file(f), fh(h), map(m), cv(pcv), remain(r) { }
+	};
+	
+	struct MemberJob : public ThreadPool::Job {
+		MemberInfo& info;
+		Member& member;
+		MemberJob(MemberInfo& i, Member& m) : info(i), member(m) { }
+		virtual void operator()();
+	};
 	
 	uint32_t mFlags;	
+	size_t mIndexThreads; // Threads to find members with, without a work pool
 	
 	
-	void readHeaders(FileHandle& fh, uint32_t& flags);
-	off_t findBlocks(FileHandle& fh, uint32_t flags, off_t uoff);
+	off_t readHeaders(const FileHandle& fh, off_t pos, uint32_t& flags) const;
+	off_t walkBlocks(Window& w, off_t pos, uint32_t flags, uint64_t& uoff,
+		BlockVec *blocks);
+	off_t findMembers(const MappedFile& map, off_t pos, size_t count,
+		MemberList& members) const;
 	
-	Checksum checksum(ChecksumType type, const Buffer& buf);
+	static Checksum checksum(ChecksumType type, const uint8_t *buf,
+		size_t size);
 	
-	virtual void checkFileType(FileHandle &fh) { readHeaders(fh, mFlags); }
+	virtual void checkFileType(FileHandle &fh) { readHeaders(fh, 0, mFlags); }
 	virtual void buildIndex(FileHandle& fh);
 	
+	void decompressData(const FileHandle& fh, const Block& b,
+		Buffer& ubuf) const;
+	
+	virtual Block* newBlock() const { return new LzopBlock(); }
+	virtual uint64_t packBlock(const Block& b) const;
+	virtual void unpackBlock(uint64_t aux, Block& b) const;
+	virtual bool readBlock(FileHandle& fh, Block* b);
+	virtual void writeBlock(FileHandle& fh, Block *b);
+	
 public:
+	static bool sniff(const Buffer& head);
+	static std::string destNameFor(const std::string& path);
 	static CompressedFile* open(const std::string& path, const OpenParams& params)
 		{ return new LzopFile(path, params); }
 	
 	LzopFile(const std::string& path, const OpenParams& params);
 	
-	virtual std::string destName() const;
+	virtual std::string destName() const { return destNameFor(path()); }
 	
 	virtual void decompressBlock(const FileHandle& fh, const Block& b,
 		Buffer& ubuf) const;
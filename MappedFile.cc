@@ -0,0 +1,42 @@
+#include "MappedFile.h"
+
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const FileHandle& fh, bool sequential)
+		: mData(0), mSize(fh.size()), mMap(0), mMapSize(0) {
+	map(fh, 0, sequential);
+}
+
+MappedFile::MappedFile(const FileHandle& fh, off_t off, size_t size,
+		bool sequential)
+		: mData(0), mSize(size), mMap(0), mMapSize(0) {
+	map(fh, off, sequential);
+}
+
+void MappedFile::map(const FileHandle& fh, off_t off, bool sequential) {
+	if (mSize == 0)
+		return; // mmap doesn't like empty maps
+	
+	// Mappings must start on a page boundary
+	const off_t page = sysconf(_SC_PAGESIZE);
+	const off_t start = off - off % page;
+	mMapSize = mSize + (off - start);
+	
+	mMap = mmap(0, mMapSize, PROT_READ, MAP_SHARED, fh.fd(), start);
+	if (mMap == MAP_FAILED) {
+		mMap = 0;
+		throw FileHandle::Exception("mmap error for file " + fh.path(),
+			errno);
+	}
+	if (sequential)
+		madvise(mMap, mMapSize, MADV_SEQUENTIAL);
+	mData = static_cast<const uint8_t*>(mMap) + (off - start);
+}
+
+MappedFile::~MappedFile() {
+	if (mMap)
+		munmap(mMap, mMapSize);
+}
@@ -0,0 +1,32 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include "lzopfs.h"
+#include "FileHandle.h"
+
+// A read-only memory map of a file, or part of one
+class MappedFile {
+protected:
+	const uint8_t *mData;
+	size_t mSize;
+	void *mMap;
+	size_t mMapSize;
+	
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+	
+	void map(const FileHandle& fh, off_t off, bool sequential);
+	
+public:
+	// Throws FileHandle::Exception if the file can't be mapped
+	MappedFile(const FileHandle& fh, bool sequential = false);
+	MappedFile(const FileHandle& fh, off_t off, size_t size,
+		bool sequential = false);
+	~MappedFile();
+	
+	const uint8_t *data() const { return mData; }
+	size_t size() const { return mSize; }
+	const uint8_t *end() const { return mData + mSize; }
+};
+
+#endif // MAPPEDFILE_H
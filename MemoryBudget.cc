@@ -0,0 +1,38 @@
+#include "MemoryBudget.h"
+
+#include <unistd.h>
+
+namespace {
+	// Fallback if we can't tell how much memory there is
+	const uint64_t FallbackLimit = 1024ULL * 1024 * 1024;
+}
+
+MemoryBudget::MemoryBudget(uint64_t limit)
+	: mLimit(limit ? limit : defaultLimit()), mUsed(0) { }
+
+// Half of physical memory, leaving room for the cache and everything else
+uint64_t MemoryBudget::defaultLimit() {
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pageSize = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || pageSize <= 0)
+		return FallbackLimit;
+	return uint64_t(pages) * pageSize / 2;
+}
+
+uint64_t MemoryBudget::used() const {
+	Lock lock(mCond);
+	return mUsed;
+}
+
+void MemoryBudget::acquire(uint64_t bytes) {
+	Lock lock(mCond);
+	while (mUsed != 0 && mUsed + bytes > mLimit)
+		mCond.wait();
+	mUsed += bytes;
+}
+
+void MemoryBudget::release(uint64_t bytes) {
+	Lock lock(mCond);
+	mUsed -= bytes;
+	mCond.broadcast();
+}
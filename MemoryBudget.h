@@ -0,0 +1,52 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include "lzopfs.h"
+#include "ThreadPool.h"
+
+// Limits how much memory decoders may use at once. Anyone who'd go over
+// waits until enough is released.
+class MemoryBudget {
+protected:
+	uint64_t mLimit, mUsed;
+	mutable ConditionVariable mCond;
+
+	MemoryBudget(const MemoryBudget&);
+	MemoryBudget& operator=(const MemoryBudget&);
+
+public:
+	// A limit of zero picks one based on the physical memory
+	MemoryBudget(uint64_t limit = 0);
+
+	static uint64_t defaultLimit();
+
+	uint64_t limit() const { return mLimit; }
+	uint64_t used() const;
+
+	// A request bigger than the whole limit is allowed once nothing else
+	// is using memory, so it can't wait forever.
+	void acquire(uint64_t bytes);
+	void release(uint64_t bytes);
+
+	// Holds memory for as long as it's in scope. A null budget is unlimited.
+	class Reservation {
+		MemoryBudget *mBudget;
+		uint64_t mBytes;
+
+		Reservation(const Reservation&);
+		Reservation& operator=(const Reservation&);
+
+	public:
+		Reservation(MemoryBudget *budget, uint64_t bytes)
+				: mBudget(budget), mBytes(bytes) {
+			if (mBudget)
+				mBudget->acquire(mBytes);
+		}
+		~Reservation() {
+			if (mBudget)
+				mBudget->release(mBytes);
+		}
+	};
+};
+
+#endif // MEMORYBUDGET_H
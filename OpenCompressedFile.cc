@@ -1,14 +1,20 @@
 #include "OpenCompressedFile.h"
 
 #include "BlockCache.h"
+#include "TR1.h"
 
 #include <cstring>
 
-OpenCompressedFile::OpenCompressedFile(const CompressedFile *file,
-		int openFlags) : mFile(file), mFH(file->path(), openFlags) { }
+OpenCompressedFile::OpenCompressedFile(const CompressedFile *file)
+		: mFile(file) {
+	FilePool::Handle fh(mFile->filePool(), mFile->id(), mFile->path());
+	mFile->hold(); // Only once the file is open, since that may throw
+}
 
 void OpenCompressedFile::decompressBlock(const Block& b, Buffer& ubuf) const {
-	mFile->decompressBlock(mFH, b, ubuf);
+	unique_ptr<Block> full(mFile->fullBlock(b));
+	FilePool::Handle fh(mFile->filePool(), mFile->id(), mFile->path());
+	mFile->decompressBlock(*fh, *full, ubuf);
 }
 
 namespace {
@@ -42,10 +48,22 @@ namespace {
 
 ssize_t OpenCompressedFile::read(BlockCache& cache,
 		char *buf, size_t size, off_t offset) const {
+	mFile->waitIndexed(offset + size);
+	if (offset >= mFile->uncompressedSize())
+		return 0;
+	
 	off_t max = offset;
-	CompressedFile::BlockIterator biter = mFile->findBlock(offset);
 	Callback cb(max, buf, size, offset);
-	cache.getBlocks(*this, biter, offset + size, cb);
+	Block blocks[ReadSpan];
+	off_t pos = offset, end = offset + size;
+	while (pos < end) {
+		size_t count = mFile->findBlocks(pos, end, blocks, ReadSpan);
+		if (count == 0)
+			break;
+		cache.getBlocks(*this, blocks, count, cb);
+		const Block& last = blocks[count - 1];
+		pos = last.uoff + last.usize;
+	}
 	
 	return max - offset;
 }
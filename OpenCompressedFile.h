@@ -3,25 +3,32 @@
 
 #include "lzopfs.h"
 #include "CompressedFile.h"
-#include "FileHandle.h"
 
 class BlockCache;
 
 class OpenCompressedFile {
 protected:
 	const CompressedFile *mFile;
-	FileHandle mFH;
+	
+	OpenCompressedFile(const OpenCompressedFile&);
+	OpenCompressedFile& operator=(const OpenCompressedFile&);
 	
 public:
-	typedef std::string FileID;
+	typedef uint64_t FileID;
+	
+	// How many blocks to look up at once when reading
+	static const size_t ReadSpan = 32;
 	
-	OpenCompressedFile(const CompressedFile *file, int openFlags);
+	// Reads share a descriptor from the file's pool. It's opened now, to
+	// report any error early.
+	OpenCompressedFile(const CompressedFile *file);
+	~OpenCompressedFile() { mFile->release(); }
 	
 	void decompressBlock(const Block& b, Buffer& ubuf) const;
 	ssize_t read(BlockCache& cache, char *buf, size_t size, off_t offset)
 		const;
 	
-	FileID id() const { return mFile->path(); }
+	FileID id() const { return mFile->id(); }
 };
 
 #endif // OPENCOMPRESSEDFILE_H
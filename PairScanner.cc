@@ -0,0 +1,111 @@
+#include "PairScanner.h"
+
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+	#define PAIRSCANNER_X86
+	#include <immintrin.h>
+#endif
+
+PairScanner::PairScanner() : mCount(0), mScan(&scanScalar) {
+	for (size_t i = 0; i < 256; ++i)
+		mFirstMask[i] = mSecondMask[i] = 0;
+	
+#ifdef PAIRSCANNER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		mScan = &scanAVX2;
+	else
+		mScan = &scanSSE2;
+#endif
+}
+
+void PairScanner::add(uint8_t first, uint8_t second) {
+	if (mCount == MaxPairs)
+		throw std::runtime_error("too many pairs to scan for");
+	mFirstMask[first] |= 1 << mCount;
+	mSecondMask[second] |= 1 << mCount;
+	mFirst[mCount] = first;
+	mSecond[mCount] = second;
+	++mCount;
+}
+
+const uint8_t *PairScanner::scanScalar(const PairScanner& s,
+		const uint8_t *begin, const uint8_t *end) {
+	for (const uint8_t *p = begin; p < end; ++p) {
+		if (s.mFirstMask[p[0]] & s.mSecondMask[p[1]])
+			return p;
+	}
+	return end;
+}
+
+#ifdef PAIRSCANNER_X86
+
+const uint8_t *PairScanner::scanSSE2(const PairScanner& s,
+		const uint8_t *begin, const uint8_t *end) {
+	const size_t W = sizeof(__m128i);
+	__m128i first[MaxPairs], second[MaxPairs];
+	for (size_t k = 0; k < s.mCount; ++k) {
+		first[k] = _mm_set1_epi8(s.mFirst[k]);
+		second[k] = _mm_set1_epi8(s.mSecond[k]);
+	}
+	
+	const uint8_t *p = begin;
+	for (; end - p >= ptrdiff_t(W); p += W) {
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		const __m128i b = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(p + 1));
+		__m128i m = _mm_setzero_si128();
+		for (size_t k = 0; k < s.mCount; ++k) {
+			m = _mm_or_si128(m, _mm_and_si128(_mm_cmpeq_epi8(a, first[k]),
+				_mm_cmpeq_epi8(b, second[k])));
+		}
+		const int bits = _mm_movemask_epi8(m);
+		if (bits)
+			return p + __builtin_ctz(bits);
+	}
+	return scanScalar(s, p, end);
+}
+
+__attribute__((target("avx2")))
+const uint8_t *PairScanner::scanAVX2(const PairScanner& s,
+		const uint8_t *begin, const uint8_t *end) {
+	const size_t W = sizeof(__m256i);
+	__m256i first[MaxPairs], second[MaxPairs];
+	for (size_t k = 0; k < s.mCount; ++k) {
+		first[k] = _mm256_set1_epi8(s.mFirst[k]);
+		second[k] = _mm256_set1_epi8(s.mSecond[k]);
+	}
+	
+	const uint8_t *p = begin;
+	for (; end - p >= ptrdiff_t(W); p += W) {
+		const __m256i a = _mm256_loadu_si256(
+			reinterpret_cast<const __m256i*>(p));
+		const __m256i b = _mm256_loadu_si256(
+			reinterpret_cast<const __m256i*>(p + 1));
+		__m256i m = _mm256_setzero_si256();
+		for (size_t k = 0; k < s.mCount; ++k) {
+			m = _mm256_or_si256(m, _mm256_and_si256(
+				_mm256_cmpeq_epi8(a, first[k]),
+				_mm256_cmpeq_epi8(b, second[k])));
+		}
+		const unsigned bits = _mm256_movemask_epi8(m);
+		if (bits)
+			return p + __builtin_ctz(bits);
+	}
+	return scanSSE2(s, p, end);
+}
+
+#else // PAIRSCANNER_X86
+
+const uint8_t *PairScanner::scanSSE2(const PairScanner& s,
+		const uint8_t *begin, const uint8_t *end) {
+	return scanScalar(s, begin, end);
+}
+
+const uint8_t *PairScanner::scanAVX2(const PairScanner& s,
+		const uint8_t *begin, const uint8_t *end) {
+	return scanScalar(s, begin, end);
+}
+
+#endif // PAIRSCANNER_X86
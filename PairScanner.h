@@ -0,0 +1,43 @@
+#ifndef PAIRSCANNER_H
+#define PAIRSCANNER_H
+
+#include "lzopfs.h"
+
+#include <cstddef>
+
+/* Quickly finds places in a buffer where two consecutive bytes match one of
+ * a small set of pairs. Good as a prefilter when looking for magic numbers,
+ * uses SIMD when the CPU has it. */
+class PairScanner {
+public:
+	static const size_t MaxPairs = 16;
+
+protected:
+	typedef const uint8_t *(*ScanFunc)(const PairScanner& s,
+		const uint8_t *begin, const uint8_t *end);
+	
+	uint8_t mFirst[MaxPairs], mSecond[MaxPairs];
+	size_t mCount;
+	uint16_t mFirstMask[256], mSecondMask[256]; // which pairs match a byte
+	ScanFunc mScan;
+	
+	static const uint8_t *scanScalar(const PairScanner& s,
+		const uint8_t *begin, const uint8_t *end);
+	static const uint8_t *scanSSE2(const PairScanner& s,
+		const uint8_t *begin, const uint8_t *end);
+	static const uint8_t *scanAVX2(const PairScanner& s,
+		const uint8_t *begin, const uint8_t *end);
+
+public:
+	PairScanner();
+	
+	void add(uint8_t first, uint8_t second);
+	
+	// Find the first p in [begin, end) where p[0], p[1] match a pair. Note
+	// that p[1] may be at end, so it must be readable. Returns end if not
+	// found.
+	const uint8_t *find(const uint8_t *begin, const uint8_t *end) const
+		{ return mScan(*this, begin, end); }
+};
+
+#endif // PAIRSCANNER_H
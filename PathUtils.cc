@@ -1,4 +1,7 @@
 #include "PathUtils.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
 #include <stdlib.h>
 using std::string;
 
@@ -60,6 +63,8 @@ string realpath(const string& path) {
 	char *abs = 0;
 	try {
 		abs = ::realpath(path.c_str(), NULL);
+		if (!abs)
+			throw std::runtime_error(path + ": " + strerror(errno));
 		string ret(abs);
 		free(abs);
 		return ret;
@@ -5,38 +5,91 @@
 #include "PathUtils.h"
 
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 
 #include <inttypes.h>
 
 const uint64_t PixzFile::MemLimit = UINT64_MAX;
 
+namespace {
+	// Decoding a block header allocates filter options, which we must free
+	void freeFilters(lzma_filter *filters) {
+		for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i) {
+			free(filters[i].options);
+			filters[i].options = NULL;
+		}
+	}
+}
+
 PixzFile::PixzFile(const std::string& path, uint64_t maxBlock)
-		: CompressedFile(path), mIndex(0) {
+		: BlockListCompFile(path) {
 	try {
-		FileHandle fh(this->path(), O_RDONLY);
-		Buffer header;
-		fh.read(header, LZMA_STREAM_HEADER_SIZE);
-		lzma_stream_flags flags;
-		lzma_ret err = lzma_stream_header_decode(&flags, &header[0]);
-		if (err == LZMA_FORMAT_ERROR)
-			throwFormat("magic mismatch");
-		else if (err == LZMA_DATA_ERROR)
-			throwFormat("corrupt header");
-		else if (err == LZMA_OPTIONS_ERROR)
-			throwFormat("unsupported options in header");
-		else if (err != LZMA_OK)
-			throwFormat("bad header");
-		
-		mIndex = readIndex(fh);
+		initialize(maxBlock);
 	} catch (FileHandle::EOFException& e) {
 		throwFormat("EOF");
 	}
-	
-	checkSizes(maxBlock);
 }
-	
-lzma_index *PixzFile::readIndex(FileHandle& fh) {
+
+bool PixzFile::sniff(const Buffer& head) {
+	if (head.size() < LZMA_STREAM_HEADER_SIZE)
+		return false;
+	lzma_stream_flags flags;
+	return lzma_stream_header_decode(&flags, &head[0]) != LZMA_FORMAT_ERROR;
+}
+
+void PixzFile::checkFileType(FileHandle &fh) {
+	Buffer header;
+	fh.read(header, LZMA_STREAM_HEADER_SIZE);
+	lzma_stream_flags flags;
+	lzma_ret err = lzma_stream_header_decode(&flags, &header[0]);
+	if (err == LZMA_FORMAT_ERROR)
+		throwFormat("magic mismatch");
+	else if (err == LZMA_DATA_ERROR)
+		throwFormat("corrupt header");
+	else if (err == LZMA_OPTIONS_ERROR)
+		throwFormat("unsupported options in header");
+	else if (err != LZMA_OK)
+		throwFormat("bad header");
+}
+
+// Flatten the index into our block list, so lookups needn't walk it
+void PixzFile::buildIndex(FileHandle& fh) {
+	lzma_index *idx = readIndex(fh);
+	try {
+		lzma_index_iter iter;
+		lzma_index_iter_init(&iter, idx);
+		while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+			if (iter.block.uncompressed_size > UINT32_MAX
+					|| iter.block.total_size > UINT32_MAX)
+				throwFormat("block too large");
+			addBlock(new PixzBlock(iter.block.uncompressed_size,
+				iter.block.total_size, iter.block.uncompressed_file_offset,
+				iter.block.compressed_file_offset, iter.stream.flags->check));
+		}
+	} catch (...) {
+		lzma_index_end(idx, 0);
+		throw;
+	}
+	lzma_index_end(idx, 0);
+}
+
+// The index at the end of the file knows the size
+bool PixzFile::quickSize(off_t& size) const {
+	if (BlockListCompFile::quickSize(size))
+		return true;
+	try {
+		FileHandle fh(path(), O_RDONLY);
+		lzma_index *idx = readIndex(fh);
+		size = lzma_index_uncompressed_size(idx);
+		lzma_index_end(idx, 0);
+		return true;
+	} catch (std::runtime_error& e) {
+		return false;
+	}
+}
+
+lzma_index *PixzFile::readIndex(FileHandle& fh) const {
 	assert(ChunkSize % 4 == 0);
 	
 	lzma_index *idx = 0;
@@ -100,22 +153,17 @@ lzma_index *PixzFile::readIndex(FileHandle& fh) {
 	}
 }
 
-PixzFile::~PixzFile() {
-	if (mIndex)
-		lzma_index_end(mIndex, 0);
-}
-
 void PixzFile::streamInit(lzma_stream& s) const {
 	// As suggested in docs for LZMA_STREAM_INIT
 	memset(&s, 0, sizeof(lzma_stream));		
 }
 
-CompressedFile::BlockIterator PixzFile::findBlock(off_t off) const {
-	lzma_index_iter *liter = new lzma_index_iter();
-	lzma_index_iter_init(liter, mIndex);
-	if (lzma_index_iter_locate(liter, off))
-		throw std::runtime_error("can't find block");
-	return BlockIterator(new Iterator(liter));
+uint64_t PixzFile::packBlock(const Block& b) const {
+	return dynamic_cast<const PixzBlock&>(b).check;
+}
+
+void PixzFile::unpackBlock(uint64_t aux, Block& b) const {
+	dynamic_cast<PixzBlock&>(b).check = lzma_check(aux);
 }
 
 // Output should be already set up
@@ -179,52 +227,43 @@ void PixzFile::decompressBlock(const FileHandle& fh, const Block& b,
 	else if (err != LZMA_OK)
 		throw std::runtime_error("unknown error in block header");
 	
+	// High presets need big dictionaries, so wait until there's room
+	uint64_t mem = lzma_raw_decoder_memusage(filters);
+	if (mem == UINT64_MAX) {
+		freeFilters(filters);
+		throwFormat("unsupported filters in block header");
+	}
+	MemoryBudget::Reservation reserve(mBudget, mem);
 	
 	// Decode the block
 	lzma_stream s;
 	streamInit(s);
-	if (lzma_block_decoder(&s, &block) != LZMA_OK)
+	err = lzma_block_decoder(&s, &block);
+	freeFilters(filters); // The decoder keeps its own copy
+	if (err != LZMA_OK)
 		throw std::runtime_error("error initializing block decoder");
 	
 	ubuf.resize(b.usize);
 	s.next_out = &ubuf[0];
 	s.avail_out = ubuf.size();
-	if (code(s, fh, b.coff + block.header_size) != LZMA_OK)
+	err = code(s, fh, b.coff + block.header_size);
+	
+	// liblzma always verifies the block check, we just count it
+	if (err == LZMA_DATA_ERROR && verifying())
+		verifyResult(b, false);
+	if (err != LZMA_OK)
 		throw std::runtime_error("error decoding block");
-}
-
-off_t PixzFile::uncompressedSize() const {
-	return lzma_index_uncompressed_size(mIndex);
-}
-
-void PixzFile::Iterator::makeBlock() {
-	mBlock.coff = mIter->block.compressed_file_offset;
-	mBlock.uoff = mIter->block.uncompressed_file_offset;
-	mBlock.csize = mIter->block.total_size;
-	mBlock.usize = mIter->block.uncompressed_size;	
-	mBlock.check = mIter->stream.flags->check;		
-}
-
-void PixzFile::Iterator::incr() {
-	if (mEnd || lzma_index_iter_next(
-			mIter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
-		mEnd = true;
-	} else {
-		makeBlock();
+	if (verifyWanted()) {
+		if (pb.check == LZMA_CHECK_NONE)
+			verifyUnavailable();
+		else
+			verifyResult(b, true);
 	}
 }
 
-CompressedFile::BlockIteratorInner *PixzFile::Iterator::dup() const {
-	if (mEnd)
-		return new Iterator();
-	
-	// Safe according to lzma_index_iter_init docs
-	return new Iterator(new lzma_index_iter(*mIter));
-}
-
-std::string PixzFile::destName() const {
+std::string PixzFile::destNameFor(const std::string& path) {
 	using namespace PathUtils;
-	std::string base = basename(path());
+	std::string base = basename(path);
 	if (replaceExtension(base, "tpxz", "tar")) return base;
 	if (replaceExtension(base, "txz", "tar")) return base;
 	if (removeExtension(base, "pxz")) return base;
@@ -8,56 +8,41 @@
 
 #include <lzma.h>
 
-class PixzFile : public CompressedFile {
+class PixzFile : public BlockListCompFile {
 protected:
 	struct PixzBlock : public Block {
 		lzma_check check;
+		PixzBlock(uint32_t us = 0, uint32_t cs = 0, uint64_t uo = 0,
+				uint64_t co = 0, lzma_check c = LZMA_CHECK_NONE)
+			: Block(us, cs, uo, co), check(c) { }
 	};
 	
-	class Iterator : public BlockIteratorInner {
-		lzma_index_iter *mIter;
-		PixzBlock mBlock;
-		bool mEnd;
-		
-		virtual void makeBlock();
-		
-		// Disable copy
-		Iterator(const Iterator& o);
-		Iterator& operator=(const Iterator& o);
-	public:
-		Iterator(lzma_index_iter *i) : mIter(i), mEnd(false) { makeBlock(); }
-		Iterator() : mIter(0), mEnd(true) { }
-		virtual ~Iterator() { if (mIter) delete mIter; }
-		virtual void incr();
-		virtual const Block& deref() const { return mBlock; }
-		virtual bool end() const { return mEnd; }
-		virtual BlockIteratorInner *dup() const;
-	};
-	
-	
 	static const uint64_t MemLimit;
 	
-	
-	lzma_index *mIndex;
-	
 	lzma_ret code(lzma_stream& s, const FileHandle& fh, off_t off = -1) const;
-	lzma_index *readIndex(FileHandle& fh);
+	lzma_index *readIndex(FileHandle& fh) const;
 	void streamInit(lzma_stream& s) const;
 	
+	virtual void checkFileType(FileHandle &fh);
+	virtual void buildIndex(FileHandle& fh);
+	
+	virtual Block* newBlock() const { return new PixzBlock(); }
+	virtual uint64_t packBlock(const Block& b) const;
+	virtual void unpackBlock(uint64_t aux, Block& b) const;
+	
 public:
+	static bool sniff(const Buffer& head);
+	static std::string destNameFor(const std::string& path);
 	static CompressedFile* open(const std::string& path, const OpenParams& params)
 		{ return new PixzFile(path, params.maxBlock); }
 	
 	PixzFile(const std::string& path, uint64_t maxBlock);
-	virtual ~PixzFile();
 		
-	virtual std::string destName() const;
+	virtual std::string destName() const { return destNameFor(path()); }
+	virtual bool quickSize(off_t& size) const;
 	
-	virtual BlockIterator findBlock(off_t off) const;
 	virtual void decompressBlock(const FileHandle& fh, const Block& b,
 		Buffer& ubuf) const;
-	
-	virtual off_t uncompressedSize() const;
 };
 
 #endif // PIXZFILE_H
@@ -10,7 +10,7 @@ ThreadPool::ThreadPool(size_t threads) : mCancelling(false) {
 	
 	if (threads == 0)
 		threads = systemCPUs();
-	mThreads.resize(threads);
+	mThreads.reserve(threads);
 	for (size_t i = 0; i < threads; ++i) {
 		mThreads.push_back(ThreadInfo(this, i));
 		ThreadInfo& info = mThreads.back();
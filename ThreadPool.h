@@ -26,6 +26,15 @@ public:
 	~Lock() { mMutex.unlock(); }
 };
 
+// Lets go of a locked mutex while it's in scope
+class Unlock {
+	Mutex& mMutex;
+	
+public:
+	Unlock(Mutex& m) : mMutex(m) { mMutex.unlock(); }
+	~Unlock() { mMutex.lock(); }
+};
+
 class ConditionVariable : public Mutex {
 	pthread_cond_t mCond;
 	
@@ -73,6 +82,7 @@ public:
 	ThreadPool(size_t threads = 0);
 	~ThreadPool();
 	
+	size_t size() const { return mThreads.size(); }
 	void enqueue(Job* job);
 };
 
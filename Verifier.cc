@@ -0,0 +1,71 @@
+#include "Verifier.h"
+
+#include <cstdio>
+
+#include <inttypes.h>
+
+bool Verifier::parseMode(const std::string& s, Mode& mode) {
+	if (s == "off")
+		mode = Off;
+	else if (s == "sampled")
+		mode = Sampled;
+	else if (s == "full")
+		mode = Full;
+	else
+		return false;
+	return true;
+}
+
+const char *Verifier::modeName(Mode mode) {
+	switch (mode) {
+		case Sampled: return "sampled";
+		case Full: return "full";
+		default: return "off";
+	}
+}
+
+Verifier::Stats Verifier::stats() const {
+	Lock lock(mMutex);
+	return mStats;
+}
+
+std::string Verifier::report() const {
+	Stats s = stats();
+	char buf[256];
+	snprintf(buf, sizeof(buf), "verify: %s\nchecked: %" PRIu64
+		"\nfailed: %" PRIu64 "\nunavailable: %" PRIu64 "\n",
+		modeName(mMode), s.checked, s.failed, s.unavailable);
+	return buf;
+}
+
+bool Verifier::wanted() {
+	if (mMode == Off)
+		return false;
+	if (mMode == Full)
+		return true;
+	
+	Lock lock(mMutex);
+	return mCount++ % SampleRate == 0;
+}
+
+void Verifier::checked(bool ok, const std::string& path, off_t uoff) {
+	{
+		Lock lock(mMutex);
+		++mStats.checked;
+		if (ok)
+			return;
+		++mStats.failed;
+	}
+	
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%" PRIu64, uint64_t(uoff));
+	std::string why = "checksum mismatch in " + path
+		+ " for block at uncompressed offset " + buf;
+	fprintf(stderr, "%s\n", why.c_str());
+	throw Failure(why);
+}
+
+void Verifier::unavailable() {
+	Lock lock(mMutex);
+	++mStats.unavailable;
+}
@@ -0,0 +1,54 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "lzopfs.h"
+#include "ThreadPool.h"
+
+#include <stdexcept>
+#include <string>
+
+#include <sys/types.h>
+
+// Decides which decompressed blocks to check, and keeps count of the results
+class Verifier {
+public:
+	enum Mode { Off, Sampled, Full };
+	
+	// A block didn't match its checksum
+	struct Failure : public std::runtime_error {
+		Failure(const std::string& s) : std::runtime_error(s) { }
+	};
+	
+	struct Stats {
+		uint64_t checked, failed, unavailable;
+		Stats() : checked(0), failed(0), unavailable(0) { }
+	};
+	
+	// When sampling, check one in this many blocks
+	static const size_t SampleRate = 16;
+	
+	static bool parseMode(const std::string& s, Mode& mode);
+	static const char *modeName(Mode mode);
+
+protected:
+	Mode mMode;
+	mutable Mutex mMutex;
+	uint64_t mCount;
+	Stats mStats;
+
+public:
+	Verifier(Mode mode = Off) : mMode(mode), mCount(0) { }
+	
+	Mode mode() const { return mMode; }
+	Stats stats() const;
+	std::string report() const;
+	
+	// Should we check the next block?
+	bool wanted();
+	
+	// Record a result. Throws Failure if the check failed.
+	void checked(bool ok, const std::string& path, off_t uoff);
+	void unavailable();
+};
+
+#endif // VERIFIER_H
@@ -0,0 +1,91 @@
+#ifdef HAVE_ZSTD
+
+#include "ZstdContext.h"
+
+#include "FileHandle.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+ZstdDictSet::~ZstdDictSet() {
+	for (Map::iterator iter = mDicts.begin(); iter != mDicts.end(); ++iter)
+		ZSTD_freeDDict(iter->second);
+}
+
+ZstdDictSet& ZstdDictSet::shared() {
+	static ZstdDictSet dicts;
+	return dicts;
+}
+
+void ZstdDictSet::load(const std::string& path) {
+	Lock lock(mMutex);
+	if (mLoaded.count(path))
+		return;
+
+	Buffer buf;
+	FileHandle fh(path, O_RDONLY);
+	fh.read(buf, fh.size());
+
+	// Frames find their dictionary by ID, so raw dictionaries are no use
+	unsigned id = ZSTD_getDictID_fromDict(buf.data(), buf.size());
+	if (id == 0)
+		throw std::runtime_error("zstd dictionary " + path + " has no ID");
+	if (mDicts.count(id)) {
+		fprintf(stderr, "WARNING: zstd dictionary %s has the same ID as "
+			"another, ignoring it\n", path.c_str());
+		mLoaded.insert(path);
+		return;
+	}
+
+	ZSTD_DDict *ddict = ZSTD_createDDict(buf.data(), buf.size());
+	if (!ddict)
+		throw std::runtime_error("can't load zstd dictionary " + path);
+	mDicts[id] = ddict;
+	mLoaded.insert(path);
+}
+
+void ZstdDictSet::load(const std::vector<std::string>& paths) {
+	for (std::vector<std::string>::const_iterator iter = paths.begin();
+			iter != paths.end(); ++iter)
+		load(*iter);
+}
+
+const ZSTD_DDict *ZstdDictSet::find(unsigned id) const {
+	Lock lock(mMutex);
+	Map::const_iterator found = mDicts.find(id);
+	return found == mDicts.end() ? 0 : found->second;
+}
+
+ZstdContextPool::~ZstdContextPool() {
+	for (size_t i = 0; i < mFree.size(); ++i)
+		ZSTD_freeDCtx(mFree[i]);
+}
+
+ZstdContextPool& ZstdContextPool::shared() {
+	static ZstdContextPool pool;
+	return pool;
+}
+
+ZSTD_DCtx *ZstdContextPool::acquire() {
+	{
+		Lock lock(mMutex);
+		if (!mFree.empty()) {
+			ZSTD_DCtx *ctx = mFree.back();
+			mFree.pop_back();
+			return ctx;
+		}
+	}
+	ZSTD_DCtx *ctx = ZSTD_createDCtx();
+	if (!ctx)
+		throw std::runtime_error("can't create zstd context");
+	return ctx;
+}
+
+void ZstdContextPool::release(ZSTD_DCtx *ctx) {
+	// Forget any half-finished frame and dictionary
+	ZSTD_DCtx_reset(ctx, ZSTD_reset_session_and_parameters);
+	Lock lock(mMutex);
+	mFree.push_back(ctx);
+}
+
+#endif // HAVE_ZSTD
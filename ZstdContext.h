@@ -0,0 +1,73 @@
+#ifndef ZSTDCONTEXT_H
+#define ZSTDCONTEXT_H
+
+#include "lzopfs.h"
+#include "ThreadPool.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <zstd.h>
+
+// Dictionaries for zstd frames, shared by all files. Each is digested once,
+// and found by the ID that frames record.
+class ZstdDictSet {
+protected:
+	typedef std::map<unsigned, ZSTD_DDict*> Map;
+	Map mDicts;
+	std::set<std::string> mLoaded;
+	mutable Mutex mMutex;
+
+	ZstdDictSet(const ZstdDictSet&);
+	ZstdDictSet& operator=(const ZstdDictSet&);
+
+public:
+	ZstdDictSet() { }
+	~ZstdDictSet();
+
+	static ZstdDictSet& shared();
+
+	// Loading the same path twice does nothing
+	void load(const std::string& path);
+	void load(const std::vector<std::string>& paths);
+
+	// Null if we don't have it
+	const ZSTD_DDict *find(unsigned id) const;
+};
+
+// Decompression contexts, reused between blocks to save on setup
+class ZstdContextPool {
+protected:
+	std::vector<ZSTD_DCtx*> mFree;
+	Mutex mMutex;
+
+	ZstdContextPool(const ZstdContextPool&);
+	ZstdContextPool& operator=(const ZstdContextPool&);
+
+public:
+	ZstdContextPool() { }
+	~ZstdContextPool();
+
+	static ZstdContextPool& shared();
+
+	ZSTD_DCtx *acquire();
+	void release(ZSTD_DCtx *ctx);
+
+	// Holds a context for as long as it's in scope
+	class Lease {
+		ZstdContextPool& mPool;
+		ZSTD_DCtx *mCtx;
+
+		Lease(const Lease&);
+		Lease& operator=(const Lease&);
+
+	public:
+		Lease(ZstdContextPool& pool) : mPool(pool), mCtx(pool.acquire()) { }
+		~Lease() { mPool.release(mCtx); }
+		ZSTD_DCtx *get() const { return mCtx; }
+	};
+};
+
+#endif // ZSTDCONTEXT_H
@@ -2,24 +2,43 @@
 
 #include "ZstdFile.h"
 
+#include "Checksum.h"
+#include "TR1.h"
+#include "ZstdContext.h"
+
+#include <cstdio>
+
 #include <zstd.h>
+#include <zstd_errors.h>
 
 namespace {
   const uint32_t MagicSkippable = 0x184D2A5E;
+  const uint32_t MagicSkippableMask = 0xFFFFFFF0;
   const uint32_t MagicSeekTable = 0x8F92EAB1;
   const size_t FooterSize = 9;
   const size_t TableOverhead = 8;
   const uint8_t ChecksumFlag = (1<<7);
+  const uint8_t FrameChecksumFlag = (1<<2);
+
+  uint32_t readLE32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+  }
+
+  bool isSkippable(uint32_t magic) {
+    return (magic & MagicSkippableMask) == (MagicSkippable & MagicSkippableMask);
+  }
 }
 
-ZstdFile::ZstdFile(const std::string& path, uint64_t maxBlock) 
-    : BlockListCompFile(path) {
-  initialize(maxBlock);
+const size_t ZstdFile::ScanChunkSize = 1024 * 1024;
+
+ZstdFile::ZstdFile(const std::string& path, const OpenParams& params)
+    : IndexedCompFile(path, params.indexRoot), mSeekable(false) {
+  initialize(params.maxBlock);
 }
 
-std::string ZstdFile::destName() const {
+std::string ZstdFile::destNameFor(const std::string& path) {
 	using namespace PathUtils;
-	std::string base = basename(path());
+	std::string base = basename(path);
 	if (removeExtension(base, "zst")) return base;
 	return base;
 }
@@ -55,33 +74,111 @@ ZstdFile::SeekTableInfo ZstdFile::findSeekTable(FileHandle& fh) const {
   return info;
 }
 
+bool ZstdFile::sniff(const Buffer& head) {
+  if (head.size() < sizeof(uint32_t))
+    return false;
+  uint32_t magic = head[0] | head[1] << 8 | head[2] << 16
+    | uint32_t(head[3]) << 24;
+  return magic == ZSTD_MAGICNUMBER || isSkippable(magic);
+}
+
 void ZstdFile::checkFileType(FileHandle &fh) {
   // Just look for the magic
   uint32_t magic;
   fh.readLE(magic);
-  if (magic != ZSTD_MAGICNUMBER) {
+  if (magic != ZSTD_MAGICNUMBER && !isSkippable(magic)) {
     throwFormat("magic mismatch");
   }
+  try {
+    findSeekTable(fh);
+    mSeekable = true;
+  } catch (std::runtime_error& e) {
+    mSeekable = false; // We'll have to scan the frames
+  }
 
-  findSeekTable(fh);
-  // TODO: handle zstd multi-block files with no seek table
+  if (!mSeekable && singleFrame(fh)) {
+    fprintf(stderr, "WARNING: %s is a single zstd frame, which can't be "
+      "read randomly. Skipping it, recompress it with pzstd or in the "
+      "seekable format.\n", path().c_str());
+    throwFormat("single frame");
+  }
 }
 
-struct ZstdStream {
-  ZSTD_DStream* dstream;
-
-  ZstdStream() {
-    dstream = ZSTD_createDStream();
+// Whether the first frame is the whole file
+bool ZstdFile::singleFrame(FileHandle& fh) const {
+  unique_ptr<MappedFile> map;
+  try {
+    map.reset(new MappedFile(fh, true));
+  } catch (FileHandle::Exception& e) {
+    // Read it instead
   }
+  const uint64_t end = map ? map->size() : fh.size();
+
+  Buffer buf;
+  const uint8_t *frame;
+  return findFrame(fh, map.get(), 0, end, buf, frame) == end;
+}
+
+void ZstdFile::loadIndex(FileHandle& fh) {
+  if (mSeekable)
+    BlockListCompFile::loadIndex(fh);
+  else
+    IndexedCompFile::loadIndex(fh);
+}
+
+bool ZstdFile::readBlock(FileHandle& fh, Block *b) {
+  if (!IndexedCompFile::readBlock(fh, b))
+    return false;
+
+  ZstdBlock *zb = dynamic_cast<ZstdBlock*>(b);
+  fh.readBE(zb->sumType);
+  fh.readBE(zb->checksum);
+  return true;
+}
+
+void ZstdFile::writeBlock(FileHandle& fh, Block *b) {
+  IndexedCompFile::writeBlock(fh, b);
+
+  const ZstdBlock *zb = dynamic_cast<const ZstdBlock*>(b);
+  fh.writeBE(zb->sumType);
+  fh.writeBE(zb->checksum);
+}
+
+// Frames compressed with a dictionary need it to decompress
+const ZSTD_DDict *ZstdFile::findDict(const void *frame, size_t size) const {
+  unsigned id = ZSTD_getDictID_fromFrame(frame, size);
+  if (id == 0)
+    return 0;
 
-  ~ZstdStream() {
-    ZSTD_freeDStream(dstream);
+  const ZSTD_DDict *ddict = ZstdDictSet::shared().find(id);
+  if (!ddict) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "no zstd dictionary with ID %u", id);
+    throwFormat(buf);
   }
-};
+  return ddict;
+}
+
+void ZstdFile::useDict(ZSTD_DCtx *ctx, const void *frame, size_t size) const {
+  const ZSTD_DDict *ddict = findDict(frame, size);
+  if (ddict)
+    ZSTD_DCtx_refDDict(ctx, ddict);
+}
+
+uint64_t ZstdFile::packBlock(const Block& b) const {
+  const ZstdBlock& zb = dynamic_cast<const ZstdBlock&>(b);
+  return uint64_t(zb.sumType) << 32 | zb.checksum;
+}
+
+void ZstdFile::unpackBlock(uint64_t aux, Block& b) const {
+  ZstdBlock& zb = dynamic_cast<ZstdBlock&>(b);
+  zb.sumType = aux >> 32;
+  zb.checksum = uint32_t(aux);
+}
 
 void ZstdFile::decompressBlock(const FileHandle& fh, const Block& b,
 		Buffer& ubuf) const {
-  ZstdStream stream;
+  ZstdContextPool::Lease ctx(ZstdContextPool::shared());
 
   ubuf.resize(b.usize);
   ZSTD_outBuffer output = { ubuf.data(), ubuf.size(), 0 };
@@ -94,35 +191,169 @@ void ZstdFile::decompressBlock(const FileHandle& fh, const Block& b,
   while (coff < cend) {
     size_t toread = std::min((size_t)(cend - coff), chunkSize);
     fh.tryPRead(coff, inbuf, toread);
+    if (coff == b.coff)
+      useDict(ctx.get(), inbuf.data(), inbuf.size());
     coff += inbuf.size();
     ZSTD_inBuffer input = { inbuf.data(), inbuf.size(), 0 };
 
     while (input.pos < input.size) {
-      size_t ret = ZSTD_decompressStream(stream.dstream, &output, &input);
+      size_t ret = ZSTD_decompressStream(ctx.get(), &output, &input);
       if (ZSTD_isError(ret)) {
+        if (ZSTD_getErrorCode(ret) == ZSTD_error_checksum_wrong && verifying())
+          verifyResult(b, false);
         throw std::runtime_error("zstd error: " + std::string(ZSTD_getErrorName(ret)));
       }
     }
   }
+
+  if (verifyWanted()) {
+    const ZstdBlock& zb = dynamic_cast<const ZstdBlock&>(b);
+    if (zb.sumType == SeekChecksum)
+      verifyResult(b, uint32_t(Checksum::xxh64(ubuf.data(), ubuf.size()))
+        == zb.checksum);
+    else if (zb.sumType == FrameChecksum)
+      verifyResult(b, true); // libzstd already checked it
+    else
+      verifyUnavailable();
+  }
 }
 
 void ZstdFile::buildIndex(FileHandle& fh) {
+  if (mSeekable)
+    readSeekTable(fh);
+  else
+    scanFrames(fh);
+}
+
+void ZstdFile::readSeekTable(FileHandle& fh) {
   SeekTableInfo info = findSeekTable(fh);
   fh.seek(info.start, SEEK_SET);
 
   uint64_t uoff = 0, coff = 0;
   for (uint32_t i = 0; i < info.count; ++i) {
-    uint32_t csize, usize, checksum;
+    uint32_t csize, usize, checksum = 0;
     fh.readLE(csize);
     fh.readLE(usize);
     if (info.hasChecksums) {
       fh.readLE(checksum);
     }
-    addBlock(new Block(usize, csize, uoff, coff));
+    addBlock(new ZstdBlock(usize, csize, uoff, coff,
+      info.hasChecksums ? SeekChecksum : NoChecksum, checksum));
     uoff += usize;
     coff += csize;
   }
 }
 
+// The seek table knows the size, without an index
+bool ZstdFile::quickSize(off_t& size) const {
+  if (!mSeekable)
+    return IndexedCompFile::quickSize(size);
+
+  try {
+    FileHandle fh(path(), O_RDONLY);
+    SeekTableInfo info = findSeekTable(fh);
+    Buffer buf;
+    fh.pread(info.start, buf, info.totalSize());
+    size = 0;
+    for (size_t i = 0; i < buf.size(); i += info.entrySize()) {
+      const uint8_t *e = &buf[i + 4];
+      size += e[0] | e[1] << 8 | e[2] << 16 | off_t(e[3]) << 24;
+    }
+    return true;
+  } catch (std::runtime_error& e) {
+    return false;
+  }
+}
+
+// Find the extent of the frame at coff, and point frame at its data
+size_t ZstdFile::findFrame(const FileHandle& fh, const MappedFile *map,
+    uint64_t coff, uint64_t end, Buffer& buf, const uint8_t*& frame) const {
+  if (map) {
+    frame = map->data() + coff;
+    size_t csize = ZSTD_findFrameCompressedSize(frame, end - coff);
+    if (ZSTD_isError(csize))
+      throwFormat(std::string("bad frame: ") + ZSTD_getErrorName(csize));
+    return csize;
+  }
+
+  // Read more and more until we have the whole frame
+  for (size_t want = ScanChunkSize; ; want *= 2) {
+    size_t avail = std::min(uint64_t(want), end - coff);
+    fh.pread(coff, buf, avail);
+    frame = buf.data();
+    size_t csize = ZSTD_findFrameCompressedSize(frame, avail);
+    if (!ZSTD_isError(csize))
+      return csize;
+    if (ZSTD_getErrorCode(csize) != ZSTD_error_srcSize_wrong
+        || coff + avail == end)
+      throwFormat(std::string("bad frame: ") + ZSTD_getErrorName(csize));
+  }
+}
+
+// Frames needn't record their size, then we have to decompress them
+uint64_t ZstdFile::measureFrame(const uint8_t *frame, size_t csize) const {
+  ZstdContextPool::Lease ctx(ZstdContextPool::shared());
+  useDict(ctx.get(), frame, csize);
+  Buffer obuf(ZSTD_DStreamOutSize());
+  ZSTD_inBuffer input = { frame, csize, 0 };
+  uint64_t usize = 0;
+  size_t ret = 1;
+  while (ret != 0) {
+    ZSTD_outBuffer output = { obuf.data(), obuf.size(), 0 };
+    ret = ZSTD_decompressStream(ctx.get(), &output, &input);
+    if (ZSTD_isError(ret))
+      throwFormat(std::string("zstd error: ") + ZSTD_getErrorName(ret));
+    usize += output.pos;
+    if (input.pos == input.size && output.pos == 0 && ret != 0)
+      throwFormat("truncated frame");
+  }
+  return usize;
+}
+
+void ZstdFile::scanFrames(FileHandle& fh) {
+  uint64_t coff = 0, uoff = 0;
+  if (mResume) {
+    // Start again at the last frame we found
+    coff = mResume->coff;
+    uoff = mResume->uoff;
+  }
+
+  unique_ptr<MappedFile> map;
+  try {
+    map.reset(new MappedFile(fh, true));
+  } catch (FileHandle::Exception& e) {
+    // Read it in chunks instead
+  }
+  const uint64_t end = map ? map->size() : fh.size();
+
+  Buffer buf;
+  while (coff < end) {
+    const uint8_t *frame;
+    size_t csize = findFrame(fh, map.get(), coff, end, buf, frame);
+    if (isSkippable(readLE32(frame))) {
+      coff += csize;
+      continue;
+    }
+
+    uint64_t usize = ZSTD_getFrameContentSize(frame, csize);
+    if (usize == ZSTD_CONTENTSIZE_ERROR)
+      throwFormat("bad frame header");
+    findDict(frame, csize); // Don't index what we can't read
+    if (usize == ZSTD_CONTENTSIZE_UNKNOWN)
+      usize = measureFrame(frame, csize);
+    // Each read of a frame decompresses all of it, so it must fit the cache
+    if (usize > mMaxBlock || usize > UINT32_MAX || csize > UINT32_MAX)
+      throwFormat("frame too large to read randomly");
+
+    if (usize > 0) {
+      uint8_t sumType = (frame[4] & FrameChecksumFlag) ? FrameChecksum
+        : NoChecksum;
+      addBlock(new ZstdBlock(usize, csize, uoff, coff, sumType));
+    }
+    coff += csize;
+    uoff += usize;
+  }
+}
+
 
 #endif // HAVE_ZSTD
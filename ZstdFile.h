@@ -4,11 +4,26 @@
 #include "lzopfs.h"
 #include "CompressedFile.h"
 #include "FileList.h"
+#include "MappedFile.h"
 
 #include <zstd.h>
 
-class ZstdFile : public BlockListCompFile {
+class ZstdFile : public IndexedCompFile {
 protected:
+	enum ChecksumType {
+		NoChecksum,
+		SeekChecksum,	// From the seek table
+		FrameChecksum	// In the frame itself, checked by libzstd
+	};
+	
+	struct ZstdBlock : public Block {
+		uint8_t sumType;
+		uint32_t checksum; // low bits of the XXH64 of the frame's contents
+		ZstdBlock(uint32_t us = 0, uint32_t cs = 0, uint64_t uo = 0,
+				uint64_t co = 0, uint8_t st = NoChecksum, uint32_t c = 0)
+			: Block(us, cs, uo, co), sumType(st), checksum(c) { }
+	};
+
 	struct SeekTableInfo {
 		uint64_t start;
 		bool hasChecksums;
@@ -23,15 +38,41 @@ protected:
 		}
 	};
 
+	// Files without a seek table need their frames scanned, in chunks
+	// of this size if we can't map the file
+	static const size_t ScanChunkSize;
+	
+	bool mSeekable;
+	
 	SeekTableInfo findSeekTable(FileHandle& fh) const;
+	void readSeekTable(FileHandle& fh);
+	bool singleFrame(FileHandle& fh) const;
+	void scanFrames(FileHandle& fh);
+	size_t findFrame(const FileHandle& fh, const MappedFile *map,
+		uint64_t coff, uint64_t end, Buffer& buf, const uint8_t*& frame) const;
+	uint64_t measureFrame(const uint8_t *frame, size_t csize) const;
+	const ZSTD_DDict *findDict(const void *frame, size_t size) const;
+	void useDict(ZSTD_DCtx *ctx, const void *frame, size_t size) const;
+	
+	// Seekable files need no index file, their seek table is enough
+	virtual void loadIndex(FileHandle& fh);
+	virtual Block* newBlock() const { return new ZstdBlock(); }
+	virtual uint64_t packBlock(const Block& b) const;
+	virtual void unpackBlock(uint64_t aux, Block& b) const;
+	virtual bool readBlock(FileHandle& fh, Block* b);
+	virtual void writeBlock(FileHandle& fh, Block *b);
+	virtual bool canResume() const { return true; }
 
 public:
+	static bool sniff(const Buffer& head);
+	static std::string destNameFor(const std::string& path);
 	static CompressedFile* open(const std::string& path, const OpenParams& params)
-		{ return new ZstdFile(path, params.maxBlock); }
+		{ return new ZstdFile(path, params); }
 	
-	ZstdFile(const std::string& path, uint64_t maxBlock);
+	ZstdFile(const std::string& path, const OpenParams& params);
 	
-	virtual std::string destName() const;
+	virtual std::string destName() const { return destNameFor(path()); }
+	virtual bool quickSize(off_t& size) const;
 	virtual void checkFileType(FileHandle &fh);
 
 	virtual void decompressBlock(const FileHandle& fh, const Block& b,
@@ -23,14 +23,23 @@ typedef uint64_t FuseFH;
 
 const size_t CacheSize = 1024 * 1024 * 32;
 const size_t DefaultBlockFactor = 32;
+const char *StatsPath = "/.lzopfs-stats"; // when verifying
+const char *ControlPath = "/.lzopfs-control"; // when not mirroring
+
+enum { KeyZstdDict };
 
 struct FSData {
 	FileList *files;
 	ThreadPool pool;
+	ThreadPool workPool; // Shared by index builds, so it must outlive them
+	ThreadPool indexPool;
 	BlockCache cache;
 	
-	FSData(FileList* f) : files(f), pool(), cache(pool) {
+	FSData(FileList* f) : files(f), pool(),
+			workPool(f->params().indexThreads),
+			indexPool(f->params().indexThreads), cache(pool) {
 		cache.maxSize(CacheSize);
+		files->buildIndexes(indexPool, workPool);
 	}
 	~FSData() { delete files; }
 };
@@ -38,6 +47,56 @@ FSData *fsdata() {
 	return reinterpret_cast<FSData*>(fuse_get_context()->private_data);
 }
 
+bool isStats(const char *path) {
+	return fsdata()->files->verifier().mode() != Verifier::Off
+		&& strcmp(path, StatsPath) == 0;
+}
+
+bool isControl(const char *path) {
+	return !fsdata()->files->mirroring() && strcmp(path, ControlPath) == 0;
+}
+
+// Reading the control file shows files that are still being added
+std::string controlReport() {
+	std::vector<std::string> adding = fsdata()->files->adding();
+	std::string report;
+	for (std::vector<std::string>::const_iterator iter = adding.begin();
+			iter != adding.end(); ++iter)
+		report += "adding " + *iter + "\n";
+	return report;
+}
+
+// Run a line written to the control file: "add SOURCE", or "remove NAME"
+// where NAME is a file's name in the mount or its source
+int control(const std::string& line) {
+	size_t space = line.find(' ');
+	std::string cmd = line.substr(0, space);
+	std::string arg = space == std::string::npos ? "" : line.substr(space + 1);
+	if (cmd.empty() && arg.empty())
+		return 0;
+	
+	if (cmd == "add" && !arg.empty()) {
+		try {
+			fsdata()->files->addLater(arg);
+			return 0;
+		} catch (std::runtime_error& e) {
+			fprintf(stderr, "Can't add %s: %s\n", arg.c_str(), e.what());
+			return -ENOENT;
+		}
+	} else if (cmd == "remove" && !arg.empty()) {
+		return fsdata()->files->remove(arg) ? 0 : -ENOENT;
+	}
+	return -EINVAL;
+}
+
+int readString(const std::string& s, char *buf, size_t size, off_t offset) {
+	if (offset >= off_t(s.size()))
+		return 0;
+	size = std::min(size, s.size() - offset);
+	memcpy(buf, s.data() + offset, size);
+	return size;
+}
+
 
 void except(std::runtime_error& e) {
 	fprintf(stderr, "%s: %s\n", typeid(e).name(), e.what());
@@ -49,8 +108,13 @@ extern "C" void *lf_init(struct fuse_conn_info *conn
 	, struct fuse_config *cfg
 #endif
 ) {
-	void *priv = fuse_get_context()->private_data;
-	return new FSData(reinterpret_cast<FileList*>(priv));
+	FileList *files = reinterpret_cast<FileList*>(
+		fuse_get_context()->private_data);
+#if FUSE_MAJOR_VERSION >= 3
+	if (files->mirroring()) // Hard links should look the same as the source
+		cfg->use_ino = 1;
+#endif
+	return new FSData(files);
 }
 
 extern "C" int lf_getattr(const char *path, struct stat *stbuf
@@ -60,17 +124,36 @@ extern "C" int lf_getattr(const char *path, struct stat *stbuf
 ) {
 	memset(stbuf, 0, sizeof(*stbuf));
 	
-	CompressedFile *file;
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 3;
-	} else if ((file = fsdata()->files->find(path))) {
+	FileList::Entry entry;
+	if (isStats(path)) {
 		stbuf->st_mode = S_IFREG | 0444;
 		stbuf->st_nlink = 1;
-		stbuf->st_size = file->uncompressedSize();
-	} else {
+		stbuf->st_size = fsdata()->files->verifier().report().size();
+	} else if (isControl(path)) {
+		stbuf->st_mode = S_IFREG | 0600;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = controlReport().size();
+	} else if (!fsdata()->files->lookup(path, entry)) {
 		return -ENOENT;
+	} else if (entry.dir) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else {
+		CompressedFile *file = entry.file;
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		
+		// Listing a directory shouldn't load or index anything. Until the
+		// file is opened, its size is unknown unless it's cheap to find.
+		off_t size = 0;
+		if (file->loaded() && file->indexComplete())
+			size = file->uncompressedSize();
+		else if (!file->quickSize(size))
+			size = 0;
+		stbuf->st_size = size;
 	}
+	if (entry.inode)
+		stbuf->st_ino = entry.inode;
 	return 0;
 }
 
@@ -93,25 +176,56 @@ extern "C" int lf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		, fuse_readdir_flags flags
 #endif
 ) {
-	if (strcmp(path, "/") != 0)
-		return -ENOENT;
-	
 	DirFiller dirFiller(buf, filler);
 	dirFiller("/.");
 	dirFiller("/..");
-	fsdata()->files->forNames(dirFiller);
+	if (!fsdata()->files->forNames(path, dirFiller))
+		return -ENOENT;
+	if (strcmp(path, "/") == 0) {
+		if (fsdata()->files->verifier().mode() != Verifier::Off)
+			dirFiller(StatsPath);
+		if (!fsdata()->files->mirroring())
+			dirFiller(ControlPath);
+	}
 	return 0;
 }
 
 extern "C" int lf_open(const char *path, struct fuse_file_info *fi) {
-	CompressedFile *file;
-	if (!(file = fsdata()->files->find(path)))
+	if (isControl(path)) {
+		fi->fh = FuseFH(new std::string()); // For a partly written line
+		fi->direct_io = 1;
+		return 0;
+	}
+	
+	// Holds the file until it's open
+	FileList::Entry entry;
+	if (!isStats(path)
+			&& (!fsdata()->files->lookup(path, entry) || !entry.file))
 		return -ENOENT;
 	if ((fi->flags & O_ACCMODE) != O_RDONLY)
 		return -EACCES;
 	
+	CompressedFile *file = entry.file;
+	if (!file) { // stats: no handle, and the size changes
+		fi->fh = 0;
+		fi->direct_io = 1;
+		return 0;
+	}
+	
+	try {
+		fsdata()->files->load(file);
+	} catch (std::runtime_error& e) {
+		fprintf(stderr, "Error loading file %s: %s\n", file->path().c_str(),
+			e.what());
+		return -EIO;
+	}
+	
 	try {
-		fi->fh = FuseFH(new OpenCompressedFile(file, O_RDONLY));
+		fi->fh = FuseFH(new OpenCompressedFile(file));
+		
+		// While indexing, the file may grow beyond the size we report
+		if (!file->indexComplete())
+			fi->direct_io = 1;
 		return 0;
 	} catch (FileHandle::Exception& e) {
 		return e.error_code;
@@ -119,42 +233,114 @@ extern "C" int lf_open(const char *path, struct fuse_file_info *fi) {
 }
 
 extern "C" int lf_release(const char *path, struct fuse_file_info *fi) {
-	delete reinterpret_cast<OpenCompressedFile*>(fi->fh);
+	if (isControl(path)) {
+		std::string *line = reinterpret_cast<std::string*>(fi->fh);
+		control(*line); // Without a newline at the end
+		delete line;
+	} else {
+		delete reinterpret_cast<OpenCompressedFile*>(fi->fh);
+		fsdata()->files->collect(); // It may have been removed
+	}
 	fi->fh = 0;
 	return 0;
 }
 
 extern "C" int lf_read(const char *path, char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi) {
+	if (isControl(path))
+		return readString(controlReport(), buf, size, offset);
+	if (!fi->fh) // stats
+		return readString(fsdata()->files->verifier().report(), buf, size,
+			offset);
+	
 	int ret = -1;
 	try {
 		ret = reinterpret_cast<OpenCompressedFile*>(fi->fh)->read(
 			fsdata()->cache, buf, size, offset);
+	} catch (Verifier::Failure& e) {
+		return -EIO; // already logged
+	} catch (CompressedFile::FormatException& e) {
+		// Just this file is unreadable, keep going
+		fprintf(stderr, "Error reading %s: %s\n", e.file.c_str(), e.what());
+		return -EIO;
 	} catch (std::runtime_error& e) {
 		except(e);
 	}
 	return ret;
 }
 
+// Only the control file can be written, a line at a time
+extern "C" int lf_write(const char *path, const char *buf, size_t size,
+		off_t offset, struct fuse_file_info *fi) {
+	if (!isControl(path))
+		return -EACCES;
+	
+	std::string *line = reinterpret_cast<std::string*>(fi->fh);
+	int err = 0;
+	for (const char *end = buf + size; buf != end; ++buf) {
+		if (*buf != '\n') {
+			line->push_back(*buf);
+			continue;
+		}
+		int ret = control(*line);
+		if (!err)
+			err = ret;
+		line->clear();
+	}
+	return err ? err : size;
+}
+
+extern "C" int lf_truncate(const char *path, off_t size
+#if FUSE_MAJOR_VERSION >= 3
+	, struct fuse_file_info *fi
+#endif
+) {
+	return isControl(path) ? 0 : -EACCES;
+}
+
 
 typedef std::vector<std::string> paths_t;
 struct OptData {
 	const char *nextSource;
 	paths_t* files;
+	paths_t* zstdDicts;
 	
 	unsigned blockFactor;
 	const char *indexRoot;
+	const char *verify;
+	unsigned decoderMemory; // in MB
+	unsigned indexThreads;
+	unsigned indexIO; // in MB
+	unsigned indexMemory; // in MB
+	unsigned openFiles;
+	int indexAtMount;
+	int probeFormats;
+	int mirror;
 };
 
 static struct fuse_opt lf_opts[] = {
 	{ "--block-factor=%lu", offsetof(OptData, blockFactor), 0 },
 	{ "--index-root=%s", offsetof(OptData, indexRoot), 0 },
+	{ "--verify=%s", offsetof(OptData, verify), 0 },
+	{ "--decoder-memory=%u", offsetof(OptData, decoderMemory), 0 },
+	{ "--index-threads=%u", offsetof(OptData, indexThreads), 0 },
+	{ "--index-io=%u", offsetof(OptData, indexIO), 0 },
+	{ "--index-memory=%u", offsetof(OptData, indexMemory), 0 },
+	{ "--open-files=%u", offsetof(OptData, openFiles), 0 },
+	{ "--index-at-mount", offsetof(OptData, indexAtMount), 1 },
+	{ "--probe-formats", offsetof(OptData, probeFormats), 1 },
+	{ "--mirror", offsetof(OptData, mirror), 1 },
+	FUSE_OPT_KEY("--zstd-dict=", KeyZstdDict),
 	{NULL, -1U, 0},
 };
 
 extern "C" int lf_opt_proc(void *data, const char *arg, int key,
 		struct fuse_args *outargs) {
 	OptData *optd = reinterpret_cast<OptData*>(data);
+	if (key == KeyZstdDict) { // May be given more than once
+		optd->zstdDicts->push_back(arg + strlen("--zstd-dict="));
+		return 0;
+	}
 	if (key == FUSE_OPT_KEY_NONOPT) {
 		if (optd->nextSource) {
 			try {
@@ -183,23 +369,49 @@ int main(int argc, char *argv[]) {
 		ops.open = lf_open;
 		ops.release = lf_release;
 		ops.read = lf_read;
+		ops.write = lf_write;
+		ops.truncate = lf_truncate;
 		ops.init = lf_init;
 		
 		// FIXME: help with options?
-		paths_t files;
-		OptData optd = { 0, &files, DefaultBlockFactor, "" };
+		paths_t files, zstdDicts;
+		OptData optd = { 0, &files, &zstdDicts, DefaultBlockFactor, "", "off",
+			0, 0, 0, 0, 0, 0, 0, 0 };
 		struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 		fuse_opt_parse(&args, &optd, lf_opts, lf_opt_proc);
 		if (optd.nextSource)
 			fuse_opt_add_arg(&args, optd.nextSource);
 		
-		OpenParams params(CacheSize, optd.indexRoot, optd.blockFactor);
+		Verifier::Mode verify;
+		if (!Verifier::parseMode(optd.verify, verify)) {
+			fprintf(stderr, "Unknown verify mode %s, use off, sampled or full\n",
+				optd.verify);
+			return 1;
+		}
+		OpenParams params(CacheSize, optd.indexRoot, optd.blockFactor, verify);
+		params.zstdDicts = zstdDicts;
+		params.decoderMemory = uint64_t(optd.decoderMemory) * 1024 * 1024;
+		params.indexThreads = optd.indexThreads;
+		params.indexIO = uint64_t(optd.indexIO) * 1024 * 1024;
+		params.indexMemory = uint64_t(optd.indexMemory) * 1024 * 1024;
+		params.openFiles = optd.openFiles;
+		params.probeFormats = optd.probeFormats;
 		
 		FileList *flist = new FileList(params);
-		for (paths_t::const_iterator iter = files.begin(); iter != files.end();
-				++iter) {
-			flist->add(*iter);
+		if (optd.mirror) {
+			if (files.size() != 1) {
+				fprintf(stderr, "Mirroring needs exactly one source directory\n");
+				return 1;
+			}
+			flist->mirror(files[0]);
+		} else {
+			for (paths_t::const_iterator iter = files.begin();
+					iter != files.end(); ++iter) {
+				flist->add(*iter);
+			}
 		}
+		if (optd.indexAtMount) // Finishes before fuse_main forks
+			flist->loadAll();
 		
 		fprintf(stderr, "Ready\n");
 		return fuse_main(args.argc, args.argv, &ops, flist);
@@ -0,0 +1,241 @@
+// Lookups in a BlockTable must agree with a plain list of its blocks:
+// across group boundaries, around empty blocks and gaps, and at the end.
+// An image of a table must attach to the same thing, and a damaged one
+// must be rejected, or at least never send lookups out of bounds.
+
+#include "lzopfs.h"
+#include "BlockTable.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+	typedef std::vector<Block> BlockVec;
+	typedef std::vector<uint64_t> AuxVec;
+
+	// Empty blocks on either side of the first group boundary, and
+	// elsewhere. A gap before block 40 starts a group early.
+	void makeBlocks(size_t n, bool emptyLast, BlockVec& blocks, AuxVec& aux) {
+		uint64_t uoff = 0, coff = 100;
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t usize = 1000 + (i * 37) % 500;
+			if (i == 15 || i == 16 || i == 31 || i == 32 || i == 33
+					|| (emptyLast && i == n - 1))
+				usize = 0;
+			if (i == 40)
+				uoff += 5000;
+			const uint32_t csize = usize / 2 + 7;
+			blocks.push_back(Block(usize, csize, uoff, coff));
+			aux.push_back(i >= 20 ? i * 3 + 1 : 0);
+			uoff += usize;
+			coff += csize;
+		}
+	}
+
+	size_t naiveFind(const BlockVec& blocks, uint64_t off) {
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			if (off < blocks[i].uoff + blocks[i].usize)
+				return i;
+		}
+		return BlockTable::npos;
+	}
+
+	size_t naiveSpan(const BlockVec& blocks, size_t i, uint64_t end,
+			Block *out, size_t max) {
+		size_t n = 0;
+		for (; i < blocks.size() && n < max; ++i) {
+			if (blocks[i].uoff >= end)
+				break;
+			if (blocks[i].usize)
+				out[n++] = blocks[i];
+		}
+		return n;
+	}
+
+	bool same(const Block& a, const Block& b) {
+		return a.usize == b.usize && a.csize == b.csize && a.uoff == b.uoff
+			&& a.coff == b.coff;
+	}
+
+	bool fail(const char *what, const char *stage, size_t i) {
+		fprintf(stderr, "FAIL: %s wrong %s, at %lu\n", what, stage,
+			(unsigned long)i);
+		return false;
+	}
+
+	bool check(const BlockTable& table, const BlockVec& blocks,
+			const AuxVec& aux, const char *stage) {
+		const Block& last = blocks.back();
+		if (table.size() != blocks.size()
+				|| table.uncompressedEnd() != last.uoff + last.usize)
+			return fail("size", stage, 0);
+
+		std::vector<uint64_t> offs;
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			Block b;
+			if (table.get(i, b) != aux[i] || !same(b, blocks[i]))
+				return fail("block", stage, i);
+
+			const uint64_t start = blocks[i].uoff, end = start + blocks[i].usize;
+			if (start)
+				offs.push_back(start - 1);
+			offs.push_back(start);
+			if (end)
+				offs.push_back(end - 1);
+			offs.push_back(end);
+			offs.push_back(end + 1);
+		}
+		offs.push_back(uint64_t(-1));
+		for (size_t i = 0; i < offs.size(); ++i) {
+			if (table.find(offs[i]) != naiveFind(blocks, offs[i]))
+				return fail("find", stage, offs[i]);
+		}
+
+		const size_t starts[] = { 0, 13, 14, 15, 16, 17, 31, 39, 40,
+			blocks.size() - 2, blocks.size() - 1, blocks.size() };
+		const size_t maxes[] = { 1, 3, 40 };
+		for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); ++s) {
+			for (size_t m = 0; m < sizeof(maxes) / sizeof(maxes[0]); ++m) {
+				for (size_t e = 0; e < offs.size(); e += 7) {
+					Block got[40], want[40];
+					const size_t n = table.span(starts[s], offs[e], got,
+						maxes[m]);
+					if (n != naiveSpan(blocks, starts[s], offs[e], want,
+							maxes[m]))
+						return fail("span size", stage, starts[s]);
+					for (size_t k = 0; k < n; ++k) {
+						if (!same(got[k], want[k]))
+							return fail("span", stage, starts[s]);
+					}
+				}
+			}
+		}
+		return true;
+	}
+
+	typedef std::vector<uint64_t> Image; // Aligned, as if it were mapped
+	const size_t ImageHeaderSize = 32; // Blocks, groups, aux flag and end
+	const size_t GroupBytes = 24;
+
+	void writeImage(const BlockTable& table, Image& image) {
+		char path[] = "/tmp/lzopfs-test-XXXXXX";
+		int fd = mkstemp(path);
+		if (fd == -1)
+			throw std::runtime_error("can't make temp file");
+		unlink(path);
+		FileHandle fh(fd);
+		table.write(fh);
+		const off_t size = fh.size();
+		image.resize(size / 8);
+		fh.pread(0, &image[0], size);
+		close(fd);
+	}
+
+	const uint8_t *bytes(const Image& image) {
+		return reinterpret_cast<const uint8_t*>(&image[0]);
+	}
+
+	// Damage to the header, group offsets or search layout is always
+	// caught. The first search entry is unused.
+	bool mustReject(const Image& image, size_t bit) {
+		const size_t byte = bit / 8, groups = image[1];
+		const size_t groupStart = ImageHeaderSize;
+		const size_t searchStart = groupStart + GroupBytes * groups;
+		const size_t searchSize = 8 * (groups + 1);
+		if (byte < groupStart)
+			return true;
+		if (byte < searchStart) // Only the first field is the offset
+			return (byte - groupStart) % GroupBytes < 8;
+		if (byte < searchStart + 2 * searchSize)
+			return (byte - searchStart) % searchSize >= 8;
+		return false;
+	}
+
+	// A damaged table that was accepted anyway must stay in bounds
+	bool inBounds(const BlockTable& table) {
+		Block b, got[4];
+		for (size_t i = 0; i < table.size(); ++i)
+			table.get(i, b);
+		for (size_t k = 0; k <= 64; ++k) {
+			const uint64_t off = table.uncompressedEnd() / 64 * k + k;
+			const size_t i = table.find(off);
+			if (i != BlockTable::npos && i >= table.size())
+				return false;
+			if (table.span(i == BlockTable::npos ? 0 : i, off + 5000, got, 4)
+					> 4)
+				return false;
+		}
+		return true;
+	}
+
+	bool checkImage(const BlockTable& table, const BlockVec& blocks,
+			const AuxVec& aux) {
+		Image image;
+		writeImage(table, image);
+		const size_t size = image.size() * 8;
+		BlockTable attached;
+		if (!attached.attach(bytes(image), size)
+				|| !check(attached, blocks, aux, "after attaching"))
+			return false;
+
+		for (size_t cut = 0; cut < size; ++cut) {
+			BlockTable t;
+			if (t.attach(bytes(image), cut)) {
+				fprintf(stderr, "FAIL: image cut to %lu attached\n",
+					(unsigned long)cut);
+				return false;
+			}
+		}
+
+		for (size_t bit = 0; bit < size * 8; ++bit) {
+			Image damaged(image);
+			reinterpret_cast<uint8_t*>(&damaged[0])[bit / 8] ^= 1 << (bit % 8);
+			BlockTable t;
+			if (!t.attach(bytes(damaged), size))
+				continue;
+			if (mustReject(image, bit)) {
+				fprintf(stderr, "FAIL: flipped bit %lu attached\n",
+					(unsigned long)bit);
+				return false;
+			}
+			if (!inBounds(t)) {
+				fprintf(stderr, "FAIL: flipped bit %lu goes out of bounds\n",
+					(unsigned long)bit);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool checkTable(size_t n, bool emptyLast) {
+		BlockVec blocks;
+		AuxVec aux;
+		makeBlocks(n, emptyLast, blocks, aux);
+
+		BlockTable table;
+		for (size_t i = 0; i < blocks.size(); ++i)
+			table.push_back(blocks[i], aux[i]);
+		if (!check(table, blocks, aux, "while growing"))
+			return false;
+		table.compact();
+		return check(table, blocks, aux, "after compacting")
+			&& checkImage(table, blocks, aux);
+	}
+}
+
+int main() {
+	int ret = 0;
+	const size_t sizes[] = { 16, 17, 100, 257 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		if (!checkTable(sizes[i], false) || !checkTable(sizes[i], true))
+			ret = 1;
+	}
+	if (ret == 0)
+		printf("OK\n");
+	return ret;
+}
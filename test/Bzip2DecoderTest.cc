@@ -0,0 +1,168 @@
+// Bzip2Decoder must agree with libbz2 on blocks at every bit offset and
+// level, and must throw rather than crash on truncated or corrupt blocks.
+
+#include "lzopfs.h"
+
+#include <cstdio>
+
+#ifdef HAVE_BZIP2
+
+#include "Bzip2Decoder.h"
+
+#include <cstdlib>
+#include <stdexcept>
+
+#include <bzlib.h>
+
+namespace {
+	const uint64_t EOSMagic = 0x177245385090ULL;
+	const size_t HeaderBits = 32; // "BZh" and the level
+	const size_t Flips = 40; // Corrupt bits to try per block
+
+	// Words with varied lengths, or runs, to reach both sides of RLE
+	void makeData(Buffer& data, size_t size, bool runs) {
+		data.resize(size);
+		for (size_t i = 0; i < size; ) {
+			const uint8_t c = 'a' + rand() % 26;
+			size_t n = runs ? 1 + rand() % 300 : 1 + rand() % 8;
+			for (; n && i < size; --n, ++i)
+				data[i] = runs ? c : 'a' + rand() % 26;
+			if (!runs && i < size)
+				data[i++] = ' ';
+		}
+	}
+
+	void compress(const Buffer& data, int level, Buffer& out) {
+		unsigned int size = data.size() + data.size() / 100 + 600;
+		out.resize(size);
+		if (BZ2_bzBuffToBuffCompress(reinterpret_cast<char*>(&out[0]), &size,
+				const_cast<char*>(reinterpret_cast<const char*>(&data[0])),
+				data.size(), level, 0, 0) != BZ_OK)
+			throw std::runtime_error("can't compress");
+		out.resize(size);
+	}
+
+	bool bit(const Buffer& buf, size_t i) {
+		return (buf[i / 8] >> (7 - i % 8)) & 1;
+	}
+
+	void setBit(Buffer& buf, size_t i, bool v) {
+		const uint8_t mask = 1 << (7 - i % 8);
+		buf[i / 8] = v ? (buf[i / 8] | mask) : (buf[i / 8] & ~mask);
+	}
+
+	// Where the block of a one-block stream ends, at the end of stream magic
+	size_t blockEnd(const Buffer& stream) {
+		const size_t bits = stream.size() * 8;
+		for (size_t pad = 0; pad < 8; ++pad) {
+			const size_t pos = bits - pad - 80;
+			uint64_t v = 0;
+			for (size_t i = 0; i < 48; ++i)
+				v = (v << 1) | bit(stream, pos + i);
+			if (v == EOSMagic)
+				return pos;
+		}
+		throw std::runtime_error("no end of stream");
+	}
+
+	// Copy bits [begin, end) of src to start at bit shift, surrounded by
+	// junk, in a buffer just big enough so overreads are caught
+	void shiftBits(const Buffer& src, size_t begin, size_t end, size_t shift,
+			Buffer& out) {
+		out.assign((shift + end - begin + 7) / 8, 0xa5);
+		for (size_t i = begin; i < end; ++i)
+			setBit(out, shift + i - begin, bit(src, i));
+	}
+
+	// Returns true if decoding threw as it should
+	bool throws(const Buffer& in, size_t begin, size_t end, char level) {
+		Buffer exact(in.begin(), in.begin() + (end + 7) / 8);
+		Buffer out;
+		try {
+			Bzip2Decoder::decode(&exact[0], begin, end, level, out);
+		} catch (Bzip2Decoder::Exception& e) {
+			return true;
+		}
+		return false;
+	}
+
+	bool check(int level, bool runs) {
+		Buffer data, stream, want;
+		makeData(data, level * 100000 - 50000, runs);
+		compress(data, level, stream);
+		const size_t end = blockEnd(stream);
+		const char lc = '0' + level;
+
+		// What libbz2 makes of the whole stream
+		unsigned int size = data.size();
+		want.resize(size);
+		if (BZ2_bzBuffToBuffDecompress(reinterpret_cast<char*>(&want[0]),
+				&size, reinterpret_cast<char*>(&stream[0]), stream.size(),
+				0, 0) != BZ_OK || size != data.size())
+			throw std::runtime_error("libbz2 can't decompress");
+
+		for (size_t shift = 0; shift < 8; ++shift) {
+			Buffer in, out;
+			shiftBits(stream, HeaderBits, end, shift, in);
+			const size_t bend = shift + end - HeaderBits;
+			Bzip2Decoder::decode(&in[0], shift, bend, lc, out);
+			if (out != want) {
+				fprintf(stderr, "FAIL: level %d shift %lu decodes wrongly\n",
+					level, (unsigned long)shift);
+				return false;
+			}
+
+			if (!throws(in, shift, bend - 100, lc)
+					|| !throws(in, shift, shift + (bend - shift) / 2, lc)
+					|| !throws(in, shift, shift + 200, lc)) {
+				fprintf(stderr, "FAIL: level %d shift %lu truncated block "
+					"decoded\n", level, (unsigned long)shift);
+				return false;
+			}
+		}
+
+		// Flip bits throughout the block, one at a time
+		Buffer in;
+		shiftBits(stream, HeaderBits, end, 3, in);
+		const size_t first = 3 + Bzip2Decoder::MagicBits;
+		const size_t bend = 3 + end - HeaderBits;
+		const size_t step = (bend - first) / Flips + 1;
+		for (size_t i = first; i < bend; i += step) {
+			setBit(in, i, !bit(in, i));
+			const bool ok = throws(in, 3, bend, lc);
+			setBit(in, i, !bit(in, i));
+			if (!ok) {
+				fprintf(stderr, "FAIL: level %d corrupt bit %lu decoded\n",
+					level, (unsigned long)i);
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+int main() {
+	srand(1);
+	int ret = 0;
+	try {
+		for (int level = 1; level <= 9; ++level) {
+			if (!check(level, false) || !check(level, true))
+				ret = 1;
+		}
+	} catch (std::runtime_error& e) {
+		fprintf(stderr, "FAIL: %s\n", e.what());
+		ret = 1;
+	}
+	if (ret == 0)
+		printf("OK\n");
+	return ret;
+}
+
+#else // HAVE_BZIP2
+
+int main() {
+	printf("Skipped, needs bzip2\n");
+	return 0;
+}
+
+#endif // HAVE_BZIP2
@@ -0,0 +1,153 @@
+// Each checksum must give the published answers, and must agree with a
+// plain bit-at-a-time version at every length around where a faster path
+// takes over, and when continued from a previous result.
+
+#include "lzopfs.h"
+#include "Checksum.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+	const size_t MaxSize = 12000; // Past two of Adler-32's modulus intervals
+
+	uint32_t slowCRC32(uint32_t crc, const uint8_t *p, size_t size) {
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i) {
+			crc ^= p[i];
+			for (size_t k = 0; k < 8; ++k)
+				crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : (crc >> 1);
+		}
+		return ~crc;
+	}
+
+	uint32_t slowBzip2CRC(uint32_t crc, const uint8_t *p, size_t size) {
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i) {
+			crc ^= uint32_t(p[i]) << 24;
+			for (size_t k = 0; k < 8; ++k)
+				crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+		}
+		return ~crc;
+	}
+
+	uint32_t slowAdler32(uint32_t adler, const uint8_t *p, size_t size) {
+		uint32_t a = adler & 0xffff, b = adler >> 16;
+		for (size_t i = 0; i < size; ++i) {
+			a = (a + p[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		return (b << 16) | a;
+	}
+
+	bool fail(const char *what, size_t size, size_t offset) {
+		fprintf(stderr, "FAIL: %s wrong for %lu bytes at offset %lu\n", what,
+			(unsigned long)size, (unsigned long)offset);
+		return false;
+	}
+
+	bool knownAnswers() {
+		const char *check = "123456789";
+		const char *wiki = "Wikipedia";
+		const char *fox = "The quick brown fox jumps over the lazy dog";
+		struct XXAnswer {
+			const char *text;
+			uint64_t seed, hash;
+		};
+		const XXAnswer xx[] = {
+			{ "", 0, 0xef46db3751d8e999ULL },
+			{ "a", 0, 0xd24ec4f1a98c6e5bULL },
+			{ "abc", 0, 0x44bc2cf5ad770999ULL },
+			{ fox, 0, 0x0b242d361fda71bcULL },
+			{ "", 1, 0xd5afba1336a3be4bULL },
+		};
+
+		if (Checksum::crc32(0, check, 9) != 0xcbf43926)
+			return fail("crc32 check value", 9, 0);
+		if (Checksum::crc32(0, fox, strlen(fox)) != 0x414fa339)
+			return fail("crc32 check value", strlen(fox), 0);
+		if (Checksum::bzip2CRC(0, check, 9) != 0xfc891918)
+			return fail("bzip2CRC check value", 9, 0);
+		if (Checksum::adler32(1, wiki, 9) != 0x11e60398)
+			return fail("adler32 check value", 9, 0);
+		if (Checksum::adler32(1, fox, strlen(fox)) != 0x5bdc0fda)
+			return fail("adler32 check value", strlen(fox), 0);
+		for (size_t i = 0; i < sizeof(xx) / sizeof(xx[0]); ++i) {
+			const size_t size = strlen(xx[i].text);
+			if (Checksum::xxh64(xx[i].text, size, xx[i].seed) != xx[i].hash)
+				return fail("xxh64 check value", size, 0);
+		}
+		return true;
+	}
+
+	// Every length near the edges of the fast paths, from unaligned starts
+	bool agrees(const uint8_t *data) {
+		const size_t sizes[] = { 0, 1, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64,
+			65, 127, 128, 200, 255, 256, 257, 271, 272, 273, 1000, 1024,
+			5535, 5536, 5537, 5552, 5553, 11104, MaxSize };
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+			const size_t size = sizes[s];
+			for (size_t off = 0; off < 4; ++off) {
+				const uint8_t *p = data + off;
+				if (Checksum::crc32(0, p, size) != slowCRC32(0, p, size))
+					return fail("crc32", size, off);
+				if (Checksum::bzip2CRC(0, p, size) != slowBzip2CRC(0, p, size))
+					return fail("bzip2CRC", size, off);
+				if (Checksum::adler32(1, p, size) != slowAdler32(1, p, size))
+					return fail("adler32", size, off);
+
+				// Continued from part way, with the sums near their limits
+				const size_t half = size / 2;
+				uint32_t crc = Checksum::crc32(0, p, half);
+				if (Checksum::crc32(crc, p + half, size - half)
+						!= slowCRC32(0, p, size))
+					return fail("continued crc32", size, off);
+				crc = Checksum::bzip2CRC(0, p, half);
+				if (Checksum::bzip2CRC(crc, p + half, size - half)
+						!= slowBzip2CRC(0, p, size))
+					return fail("continued bzip2CRC", size, off);
+				const uint32_t high = 0xfff0fff0;
+				if (Checksum::adler32(high, p, size)
+						!= slowAdler32(high, p, size))
+					return fail("continued adler32", size, off);
+			}
+		}
+		return true;
+	}
+
+	// XXH64 has no slow version to compare with, but its long-input path
+	// must see every byte and every length
+	bool xxh64Distinct(uint8_t *data) {
+		const size_t sizes[] = { 31, 32, 33, 63, 64, 100 };
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+			const uint64_t h = Checksum::xxh64(data, sizes[s]);
+			if (h == Checksum::xxh64(data, sizes[s] - 1))
+				return fail("xxh64 length", sizes[s], 0);
+			for (size_t i = 0; i < sizes[s]; ++i) {
+				data[i] ^= 1;
+				const bool same = Checksum::xxh64(data, sizes[s]) == h;
+				data[i] ^= 1;
+				if (same)
+					return fail("xxh64 change", sizes[s], i);
+			}
+		}
+		return true;
+	}
+}
+
+int main() {
+	Buffer data(MaxSize + 4);
+	srand(1);
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = rand() & 0xff;
+	Buffer ones(MaxSize + 4, 0xff); // The largest sums
+
+	int ret = 0;
+	if (!knownAnswers() || !agrees(&data[0]) || !agrees(&ones[0])
+			|| !xxh64Distinct(&data[0]))
+		ret = 1;
+	if (ret == 0)
+		printf("OK\n");
+	return ret;
+}
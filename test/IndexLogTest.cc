@@ -0,0 +1,167 @@
+// An index log cut short, whether mid-record or right after a checkpoint,
+// must resume to the same index as a clean build.
+
+#include "lzopfs.h"
+
+#include <cstdio>
+
+#ifdef HAVE_BZIP2
+
+#include "Bzip2File.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <bzlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+	const size_t DataSize = 2 * 1024 * 1024;
+
+	// Leaves its log behind, with a checkpoint after every block
+	class LogFile : public Bzip2File {
+	public:
+		std::vector<off_t> checkpoints; // Where each one ends
+
+		LogFile(const std::string& path, const OpenParams& params)
+			: Bzip2File(path, params) { }
+		std::string log() const { return partialIndexPath(); }
+
+	protected:
+		virtual void blocksReady(BlockList::const_iterator begin,
+				BlockList::const_iterator end) {
+			Bzip2File::blocksReady(begin, end);
+			writeControl(ControlCheckpoint);
+			checkpoints.push_back(mIndexOut.tell());
+		}
+		virtual void finishIndex() { BlockListCompFile::finishIndex(); }
+	};
+
+	class ResumeFile : public Bzip2File {
+	public:
+		ResumeFile(const std::string& path, const OpenParams& params)
+			: Bzip2File(path, params) { }
+		std::string image() const { return indexPath(); }
+		std::string log() const { return partialIndexPath(); }
+		bool resuming() const { return mResume; }
+	};
+
+	// Compressible, so blocks are of varied sizes
+	void writeBzip2(const std::string& path) {
+		Buffer data(DataSize);
+		srand(1);
+		for (size_t i = 0; i < data.size(); ++i)
+			data[i] = 'a' + rand() % (1 + (i / 4096) % 26);
+
+		unsigned int size = data.size() + data.size() / 100 + 600;
+		Buffer out(size);
+		if (BZ2_bzBuffToBuffCompress(reinterpret_cast<char*>(&out[0]), &size,
+				reinterpret_cast<char*>(&data[0]), data.size(), 1, 0, 0)
+				!= BZ_OK)
+			throw std::runtime_error("can't compress");
+		FileHandle fh(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		fh.write(&out[0], size);
+	}
+
+	void readAll(const std::string& path, Buffer& buf) {
+		FileHandle fh(path, O_RDONLY);
+		fh.pread(0, buf, fh.size());
+	}
+
+	void copyPrefix(const std::string& from, const std::string& to,
+			off_t size) {
+		Buffer buf;
+		readAll(from, buf);
+		FileHandle fh(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		fh.write(&buf[0], size);
+	}
+
+	// Build an index in dir, resuming from the log if there is one
+	bool build(const std::string& path, const std::string& dir,
+			bool resume, Buffer& image) {
+		ResumeFile file(path, OpenParams(DataSize, dir, 32));
+		file.load();
+		if (file.resuming() != resume) {
+			fprintf(stderr, "FAIL: %s resume\n", resume ? "didn't" : "did");
+			return false;
+		}
+		file.buildPending();
+		if (access(file.log().c_str(), F_OK) == 0) {
+			fprintf(stderr, "FAIL: log left behind\n");
+			return false;
+		}
+		readAll(file.image(), image);
+		return true;
+	}
+}
+
+int main() {
+	char dir[] = "/tmp/lzopfs-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	const std::string path = std::string(dir) + "/data.bz2";
+	const std::string clean = std::string(dir) + "/clean";
+	const std::string logs = std::string(dir) + "/logs";
+	const std::string resumed = std::string(dir) + "/resumed";
+
+	int ret = 1;
+	try {
+		writeBzip2(path);
+		mkdir(clean.c_str(), 0755);
+		mkdir(logs.c_str(), 0755);
+		mkdir(resumed.c_str(), 0755);
+
+		Buffer want;
+		if (!build(path, clean, false, want))
+			throw std::runtime_error("clean build failed");
+
+		LogFile logFile(path, OpenParams(DataSize, logs, 32));
+		logFile.load();
+		logFile.buildPending();
+		const std::vector<off_t>& cps = logFile.checkpoints;
+		if (cps.size() < 4)
+			throw std::runtime_error("too few blocks");
+
+		// After a checkpoint, and partway through the records after one
+		const off_t cuts[] = { cps[cps.size() / 3], cps[cps.size() / 2] + 5,
+			cps.back() - 1 };
+		const ResumeFile names(path, OpenParams(DataSize, resumed, 32));
+		ret = 0;
+		for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); ++i) {
+			unlink(names.image().c_str());
+			copyPrefix(logFile.log(), names.log(), cuts[i]);
+			Buffer got;
+			if (!build(path, resumed, true, got)) {
+				ret = 1;
+			} else if (got != want) {
+				fprintf(stderr, "FAIL: index cut at %lld differs\n",
+					(long long)cuts[i]);
+				ret = 1;
+			}
+		}
+	} catch (std::runtime_error& e) {
+		fprintf(stderr, "FAIL: %s\n", e.what());
+		ret = 1;
+	}
+
+	std::string rm = std::string("rm -rf ") + dir;
+	if (system(rm.c_str()) != 0)
+		fprintf(stderr, "Can't remove %s\n", dir);
+	if (ret == 0)
+		printf("OK\n");
+	return ret;
+}
+
+#else // HAVE_BZIP2
+
+int main() {
+	printf("Skipped, needs bzip2\n");
+	return 0;
+}
+
+#endif // HAVE_BZIP2
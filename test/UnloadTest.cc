@@ -0,0 +1,120 @@
+// A file that's unloaded, then rewritten in place at the same size, must
+// get a new index when it's loaded again.
+
+#include "lzopfs.h"
+
+#include <cstdio>
+
+#ifdef HAVE_ZLIB
+
+#include "BlockCache.h"
+#include "FileList.h"
+#include "GzipFile.h"
+#include "OpenCompressedFile.h"
+#include "ThreadPool.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <utime.h>
+#include <zlib.h>
+
+namespace {
+	const size_t DataSize = 4 * 1024 * 1024;
+
+	void randomData(Buffer& data, unsigned seed) {
+		srand(seed);
+		data.resize(DataSize);
+		for (size_t i = 0; i < data.size(); ++i)
+			data[i] = rand() & 0xff;
+	}
+
+	// Stored, not compressed, so the same amount of data is always the same
+	// size. Rewrites in place, keeping the inode.
+	void writeGzip(const std::string& path, const Buffer& data, time_t mtime) {
+		gzFile gz = gzopen(path.c_str(), "wb0");
+		if (!gz || gzwrite(gz, &data[0], data.size()) != int(data.size())
+				|| gzclose(gz) != Z_OK)
+			throw std::runtime_error("can't write " + path);
+		struct utimbuf times = { mtime, mtime };
+		utime(path.c_str(), &times);
+	}
+
+	bool readsAs(BlockCache& cache, const CompressedFile *file,
+			const Buffer& data) {
+		OpenCompressedFile ocf(file);
+		Buffer buf(data.size());
+		return ocf.read(cache, reinterpret_cast<char*>(&buf[0]), buf.size(), 0)
+				== ssize_t(data.size())
+			&& memcmp(&buf[0], &data[0], data.size()) == 0;
+	}
+
+	// Load the file, building its index if needed. Returns whether it was.
+	bool load(CompressedFile& file) {
+		file.load();
+		if (!file.indexPending())
+			return false;
+		file.buildPending();
+		return true;
+	}
+}
+
+int main() {
+	char dir[] = "/tmp/lzopfs-test-XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	const std::string path = std::string(dir) + "/data.gz";
+
+	int ret = 1;
+	try {
+		Buffer first, second;
+		randomData(first, 1);
+		randomData(second, 2);
+		const time_t then = time(NULL) - 100;
+		writeGzip(path, first, then);
+
+		OpenParams params(DataSize, dir, 32);
+		GzipFile file(path, params);
+		ThreadPool pool;
+		BlockCache cache(pool);
+		cache.maxSize(2 * DataSize);
+
+		if (!load(file))
+			fprintf(stderr, "FAIL: index wasn't built at first\n");
+		else if (!readsAs(cache, &file, first))
+			fprintf(stderr, "FAIL: wrong data at first\n");
+		else if (!file.unload())
+			fprintf(stderr, "FAIL: couldn't unload\n");
+		else {
+			writeGzip(path, second, then + 10);
+			if (!load(file))
+				fprintf(stderr, "FAIL: index wasn't rebuilt\n");
+			else if (!readsAs(cache, &file, second))
+				fprintf(stderr, "FAIL: wrong data after rewriting\n");
+			else
+				ret = 0;
+		}
+	} catch (std::runtime_error& e) {
+		fprintf(stderr, "FAIL: %s\n", e.what());
+	}
+
+	std::string rm = std::string("rm -rf ") + dir;
+	if (system(rm.c_str()) != 0)
+		fprintf(stderr, "Can't remove %s\n", dir);
+	if (ret == 0)
+		printf("OK\n");
+	return ret;
+}
+
+#else // HAVE_ZLIB
+
+int main() {
+	printf("Skipped, needs zlib\n");
+	return 0;
+}
+
+#endif // HAVE_ZLIB